@@ -0,0 +1,518 @@
+/*
+ * Micro-benchmarks of the wavelet tree API over synthetic sequences.
+ *
+ * usage: bench [-n len] [-q queries] [-t seconds] [-s seed] [-d dataset] [-k kernels] [-j threads] [-x] [-r]
+ *
+ * Without -n, each dataset is measured at 1e5 and 1e6 elements. -n may be
+ * given several times, e.g. -n 10000000 -n 100000000. -x additionally builds
+ * a tree with DISTINCT and SUMS for the queries needing them, which takes
+ * about 33 times the memory of the sequence per level. Each query runs up to
+ * the given count or for about -t seconds, whichever comes first. -k forces
+ * the build and batch kernels (scalar, popcnt, avx2 or avx512) instead of the
+ * best ones the CPU supports. -j builds with the given number of threads.
+ * -r instead measures the two endpoint ranks taken at each level of a range
+ * traversal, as two fid_rank calls and as one fid_rank_range, over a random
+ * bit vector of each length and ranges of a few spans.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "wavelet_tree.h"
+#include "kernels.h"
+
+#define MAX_LENS 8
+#define ZIPF_VALUES 100000
+#define ZIPF_EXPONENT 1.1
+#define RUN_LENGTH 64
+#define SMALL_SIGMA 16
+#define MIN_SAMPLES 10
+#define RANK_BATCH 64
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static size_t rng_below(size_t n) {
+    return n ? rng() % n : 0;
+}
+
+/*
+ * Datasets
+ */
+
+static void gen_uniform(int32_t *data, size_t n) {
+    size_t i;
+    for(i = 0; i < n; ++i)
+        data[i] = (int32_t)rng();
+}
+
+static void gen_zipf(int32_t *data, size_t n) {
+    size_t i, r;
+    double *cdf = malloc(ZIPF_VALUES * sizeof(double)), total = 0;
+    for(r = 0; r < ZIPF_VALUES; ++r)
+        cdf[r] = total += 1.0 / pow(r + 1, ZIPF_EXPONENT);
+
+    for(i = 0; i < n; ++i) {
+        double u = (double)(rng() >> 11) / (1ULL << 53) * total;
+        size_t l = 0, h = ZIPF_VALUES - 1;
+        while (l < h) {
+            size_t m = (l + h) >> 1;
+            if (cdf[m] < u) l = m + 1;
+            else h = m;
+        }
+        // scatter the ranks over the alphabet
+        data[i] = (int32_t)(uint32_t)(l * 2654435761u);
+    }
+    free(cdf);
+}
+
+static void gen_runs(int32_t *data, size_t n) {
+    size_t i = 0, len;
+    while (i < n) {
+        int32_t value = (int32_t)rng();
+        for(len = 1 + rng_below(2 * RUN_LENGTH); len && i < n; --len)
+            data[i++] = value;
+    }
+}
+
+static void gen_small_sigma(int32_t *data, size_t n) {
+    size_t i;
+    for(i = 0; i < n; ++i)
+        data[i] = rng_below(SMALL_SIGMA);
+}
+
+typedef struct dataset {
+    const char *name;
+    void (*gen)(int32_t*, size_t);
+} dataset;
+
+static const dataset datasets[] = {
+    {"uniform", gen_uniform},
+    {"zipf", gen_zipf},
+    {"runs", gen_runs},
+    {"small-sigma", gen_small_sigma},
+};
+
+/*
+ * Queries
+ */
+
+typedef struct bench_ctx {
+    const wt_tree *tree, *aux;
+    const int32_t *data;
+    size_t n;
+} bench_ctx;
+
+static volatile int64_t sink;
+
+static void sink_callback(void *user_data, int32_t value, int count) {
+    sink += value + count;
+}
+
+static void sink_counts_callback(void *user_data, int32_t value, int count1, int count2) {
+    sink += value + count1 + count2;
+}
+
+static void random_range(const bench_ctx *b, size_t *i, size_t *j) {
+    size_t x = rng_below(b->n + 1), y = rng_below(b->n + 1);
+    *i = x < y ? x : y;
+    *j = x < y ? y : x;
+}
+
+static int32_t random_value(const bench_ctx *b) {
+    return b->data[rng_below(b->n)];
+}
+
+static void q_access(const bench_ctx *b) {
+    int32_t res;
+    wt_access(b->tree, rng_below(b->n), &res);
+    sink += res;
+}
+
+static void q_rank(const bench_ctx *b) {
+    sink += wt_rank(b->tree, random_value(b), rng_below(b->n + 1));
+}
+
+static void q_select(const bench_ctx *b) {
+    int32_t v = random_value(b);
+    sink += wt_select(b->tree, v, 1 + rng_below(wt_rank(b->tree, v, b->n)));
+}
+
+static void q_quantile(const bench_ctx *b) {
+    size_t i, j;
+    int32_t res = 0;
+    random_range(b, &i, &j);
+    wt_quantile(b->tree, i, j, 1 + rng_below(j - i), &res);
+    sink += res;
+}
+
+static void q_quantiles(const bench_ctx *b) {
+    size_t i, j, ks[4], p;
+    int32_t res[4];
+    random_range(b, &i, &j);
+    for(p = 0; p < 4; ++p)
+        ks[p] = 1 + (j - i) * p / 4;
+    wt_quantiles(b->tree, i, j, ks, 4, res);
+    sink += res[0];
+}
+
+static void q_range_freq(const bench_ctx *b) {
+    size_t i, j;
+    int32_t x = random_value(b), y = random_value(b);
+    random_range(b, &i, &j);
+    sink += wt_range_freq(b->tree, i, j, x < y ? x : y, x < y ? y : x);
+}
+
+static void q_range_hist(const bench_ctx *b) {
+    size_t i, j, p;
+    int32_t edges[9];
+    int counts[8];
+    random_range(b, &i, &j);
+    for(p = 0; p < 9; ++p)
+        edges[p] = INT32_MIN + (int32_t)(p * (UINT32_MAX / 8));
+    wt_range_hist(b->tree, i, j, edges, 9, counts);
+    sink += counts[0];
+}
+
+static void q_range_list(const bench_ctx *b) {
+    size_t i, j;
+    int32_t x = random_value(b);
+    random_range(b, &i, &j);
+    // a narrow value window so the answer stays small
+    sink += wt_range_list(b->tree, i, j, x, x + (1 << 20), sink_callback, NULL);
+}
+
+static void q_prev_value(const bench_ctx *b) {
+    size_t i, j;
+    int32_t x = random_value(b), y = random_value(b);
+    random_range(b, &i, &j);
+    sink += wt_prev_value(b->tree, i, j, x < y ? x : y, x < y ? y : x);
+}
+
+static void q_next_value(const bench_ctx *b) {
+    size_t i, j;
+    int32_t x = random_value(b), y = random_value(b);
+    random_range(b, &i, &j);
+    sink += wt_next_value(b->tree, i, j, x < y ? x : y, x < y ? y : x);
+}
+
+static void q_topk(const bench_ctx *b) {
+    size_t i, j;
+    random_range(b, &i, &j);
+    sink += wt_topk(b->tree, i, j, 10, sink_callback, NULL);
+}
+
+static void q_range_mink(const bench_ctx *b) {
+    size_t i, j;
+    random_range(b, &i, &j);
+    sink += wt_range_mink(b->tree, i, j, 10, sink_callback, NULL);
+}
+
+static void q_range_maxk(const bench_ctx *b) {
+    size_t i, j;
+    random_range(b, &i, &j);
+    sink += wt_range_maxk(b->tree, i, j, 10, sink_callback, NULL);
+}
+
+static void q_range_heavy(const bench_ctx *b) {
+    size_t i, j;
+    random_range(b, &i, &j);
+    sink += wt_range_heavy(b->tree, i, j, (j - i) / 100 + 1, sink_callback, NULL);
+}
+
+static void q_intersect(const bench_ctx *b) {
+    size_t i1, j1, i2, j2;
+    random_range(b, &i1, &j1);
+    random_range(b, &i2, &j2);
+    // short ranges keep the answer bounded on high-entropy data
+    if (i1 + 1024 < j1) j1 = i1 + 1024;
+    if (i2 + 1024 < j2) j2 = i2 + 1024;
+    sink += wt_range_intersect(b->tree, i1, j1, i2, j2, sink_counts_callback, NULL);
+}
+
+static void q_quantile_multi(const bench_ctx *b) {
+    wt_interval ranges[3];
+    size_t p, len = 0;
+    int32_t res = 0;
+    for(p = 0; p < 3; ++p) {
+        random_range(b, &ranges[p].i, &ranges[p].j);
+        len += ranges[p].j - ranges[p].i;
+    }
+    wt_quantile_multi(b->tree, ranges, 3, 1 + rng_below(len), &res);
+    sink += res;
+}
+
+static void q_next_pos(const bench_ctx *b) {
+    sink += wt_next_pos(b->tree, random_value(b), rng_below(b->n));
+}
+
+static void q_positions(const bench_ctx *b) {
+    size_t i, j, res[16];
+    random_range(b, &i, &j);
+    sink += wt_positions(b->tree, random_value(b), i, j, 0, 16, res, NULL);
+}
+
+static void q_get_range(const bench_ctx *b) {
+    int32_t res[64];
+    size_t i = rng_below(b->n), j = i + 64 < b->n ? i + 64 : b->n;
+    sink += wt_get_range(b->tree, i, j, res);
+}
+
+static void q_distinct(const bench_ctx *b) {
+    size_t i, j;
+    random_range(b, &i, &j);
+    sink += wt_range_distinct(b->aux, i, j);
+}
+
+static void q_range_sum(const bench_ctx *b) {
+    size_t i, j;
+    int32_t x = random_value(b), y = random_value(b);
+    random_range(b, &i, &j);
+    sink += wt_range_sum(b->aux, i, j, x < y ? x : y, x < y ? y : x);
+}
+
+static void q_kth_sum(const bench_ctx *b) {
+    size_t i, j;
+    random_range(b, &i, &j);
+    sink += wt_kth_sum(b->aux, i, j, 1 + rng_below(j - i));
+}
+
+typedef struct query {
+    const char *name;
+    void (*run)(const bench_ctx*);
+    // the query needs the tree built with DISTINCT and SUMS
+    int aux;
+    // fraction of the query count to run, for the expensive ones
+    int divisor;
+} query;
+
+static const query queries[] = {
+    {"access", q_access, 0, 1},
+    {"rank", q_rank, 0, 1},
+    {"select", q_select, 0, 1},
+    {"quantile", q_quantile, 0, 1},
+    {"quantiles/4", q_quantiles, 0, 1},
+    {"range_freq", q_range_freq, 0, 1},
+    {"range_hist/8", q_range_hist, 0, 1},
+    {"range_list", q_range_list, 0, 1},
+    {"prev_value", q_prev_value, 0, 1},
+    {"next_value", q_next_value, 0, 1},
+    {"topk/10", q_topk, 0, 10},
+    {"range_mink/10", q_range_mink, 0, 1},
+    {"range_maxk/10", q_range_maxk, 0, 1},
+    {"range_heavy/1%", q_range_heavy, 0, 10},
+    {"intersect/1k", q_intersect, 0, 10},
+    {"quantile_multi/3", q_quantile_multi, 0, 1},
+    {"next_pos", q_next_pos, 0, 1},
+    {"positions/16", q_positions, 0, 1},
+    {"get_range/64", q_get_range, 0, 1},
+    {"distinct", q_distinct, 1, 1},
+    {"range_sum", q_range_sum, 1, 1},
+    {"kth_sum", q_kth_sum, 1, 1},
+};
+
+/*
+ * Endpoint ranks of one level
+ */
+
+// Ranges are drawn beforehand and each sample takes RANK_BATCH pairs of
+// ranks, so that reading the clock doesn't drown the difference
+static fid *rank_fid;
+static size_t *rank_is, *rank_js, rank_next, rank_len;
+
+static void q_rank_separate(const bench_ctx *b) {
+    size_t p, q;
+    for(p = 0; p < RANK_BATCH; ++p) {
+        q = rank_next++ % rank_len;
+        sink += fid_rank(rank_fid, 1, rank_is[q]) + fid_rank(rank_fid, 1, rank_js[q]);
+    }
+}
+
+static void q_rank_fused(const bench_ctx *b) {
+    size_t p, q;
+    for(p = 0; p < RANK_BATCH; ++p) {
+        q = rank_next++ % rank_len;
+        fid_ranks r = fid_rank_range(rank_fid, rank_is[q], rank_js[q]);
+        sink += r.i1 + r.j1;
+    }
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double time_limit = 1.0;
+
+static void run_query(const query *q, const bench_ctx *b, size_t count, uint64_t *samples) {
+    size_t p;
+    uint64_t total = 0, start, limit = time_limit * 1e9;
+    if (count == 0) count = 1;
+    for(p = 0; p < count; ++p) {
+        start = wt_clock_ns();
+        q->run(b);
+        samples[p] = wt_clock_ns() - start;
+        total += samples[p];
+        if (limit < total && MIN_SAMPLES <= p + 1) {
+            count = p + 1;
+            break;
+        }
+    }
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+    printf("  %-18s %8zu %10.0f %10llu %10llu %10llu\n", q->name, count, (double)total / count,
+        (unsigned long long)samples[count / 2],
+        (unsigned long long)samples[count * 9 / 10],
+        (unsigned long long)samples[count * 99 / 100]);
+    fflush(stdout);
+}
+
+static wt_tree *build(const int32_t *data, size_t n, int flags, int32_t *work, double *ms) {
+    // wt_build reorders its input
+    memcpy(work, data, n * sizeof(int32_t));
+    wt_tree *tree = wt_new();
+    tree->flags = flags;
+    uint64_t start = wt_clock_ns();
+    wt_build(tree, work, n);
+    *ms = (wt_clock_ns() - start) / 1e6;
+    return tree;
+}
+
+static void run_dataset(const dataset *d, size_t n, size_t count, int aux) {
+    int32_t *data = malloc(n * sizeof(int32_t)), *work = malloc(n * sizeof(int32_t));
+    uint64_t *samples = malloc((count + 1) * sizeof(uint64_t));
+    size_t q;
+    double ms;
+    d->gen(data, n);
+
+    bench_ctx b = {NULL, NULL, data, n};
+    wt_tree *tree = build(data, n, 0, work, &ms);
+    b.tree = tree;
+    printf("%s n=%zu build=%.1fms bits/elem=%.2f\n", d->name, n, ms, wt_memory_usage(tree) * 8.0 / n);
+
+    wt_tree *aux_tree = NULL;
+    if (aux) {
+        aux_tree = build(data, n, WT_FLAG_DISTINCT | WT_FLAG_SUMS, work, &ms);
+        b.aux = aux_tree;
+        printf("  with DISTINCT|SUMS build=%.1fms bits/elem=%.2f\n", ms, wt_memory_usage(aux_tree) * 8.0 / n);
+    }
+
+    printf("  %-18s %8s %10s %10s %10s %10s  (ns/op)\n", "query", "count", "mean", "p50", "p90", "p99");
+    for(q = 0; q < sizeof(queries) / sizeof(queries[0]); ++q) {
+        if (queries[q].aux && !aux_tree) continue;
+        run_query(&queries[q], &b, count / queries[q].divisor, samples);
+    }
+    printf("\n");
+
+    if (aux_tree) wt_free(aux_tree);
+    wt_free(tree);
+    free(samples);
+    free(work);
+    free(data);
+}
+
+static void run_ranks(size_t n, size_t count) {
+    static const size_t spans[] = {64, 1000, 100000};
+    uint64_t *words = malloc(((n >> 6) + 1) * sizeof(uint64_t)), *samples = malloc((count + 1) * sizeof(uint64_t));
+    size_t p, s;
+    char separate[32], fused[32];
+    for(p = 0; p <= (n >> 6); ++p)
+        words[p] = rng();
+
+    rank_fid = fid_new(words, n);
+    rank_len = count < RANK_BATCH ? RANK_BATCH : count;
+    rank_is = malloc(rank_len * sizeof(size_t));
+    rank_js = malloc(rank_len * sizeof(size_t));
+    printf("fid n=%zu, %d rank pairs per sample\n", n, RANK_BATCH);
+    printf("  %-18s %8s %10s %10s %10s %10s  (ns/sample)\n", "ranks", "count", "mean", "p50", "p90", "p99");
+    for(s = 0; s < sizeof(spans) / sizeof(spans[0]); ++s) {
+        for(p = 0; p < rank_len; ++p) {
+            rank_is[p] = rng_below(n + 1);
+            rank_js[p] = rank_is[p] + rng_below(spans[s]);
+            if (n < rank_js[p]) rank_js[p] = n;
+        }
+        snprintf(separate, sizeof(separate), "separate/%zu", spans[s]);
+        snprintf(fused, sizeof(fused), "fused/%zu", spans[s]);
+        query qs = {separate, q_rank_separate, 0, 1}, qf = {fused, q_rank_fused, 0, 1};
+        rank_next = 0;
+        run_query(&qs, NULL, count / RANK_BATCH, samples);
+        rank_next = 0;
+        run_query(&qf, NULL, count / RANK_BATCH, samples);
+    }
+    printf("\n");
+
+    fid_free(rank_fid);
+    free(rank_is);
+    free(rank_js);
+    free(samples);
+}
+
+int main(int argc, char **argv) {
+    size_t lens[MAX_LENS], nlens = 0, count = 100000, d, l;
+    const char *only = NULL, *kernels = NULL;
+    int opt, aux = 0, ranks = 0;
+    while ((opt = getopt(argc, argv, "n:q:t:s:d:k:j:xr")) != -1) {
+        switch (opt) {
+        case 'n':
+            if (nlens < MAX_LENS) lens[nlens++] = strtod(optarg, NULL);
+            break;
+        case 'q':
+            count = strtod(optarg, NULL);
+            break;
+        case 't':
+            time_limit = strtod(optarg, NULL);
+            break;
+        case 's':
+            rng_state = strtoull(optarg, NULL, 10) | 1;
+            break;
+        case 'd':
+            only = optarg;
+            break;
+        case 'k':
+            kernels = optarg;
+            break;
+        case 'j':
+            wt_set_build_threads(atoi(optarg));
+            break;
+        case 'x':
+            aux = 1;
+            break;
+        case 'r':
+            ranks = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n len] [-q queries] [-t seconds] [-s seed] [-d dataset] [-k kernels] [-j threads] [-x] [-r]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!nlens) {
+        lens[nlens++] = 100000;
+        lens[nlens++] = 1000000;
+    }
+    if (!wt_kernels_init(kernels)) {
+        fprintf(stderr, "%s: kernels %s are not supported by this CPU\n", argv[0], kernels);
+        return 1;
+    }
+    printf("kernels: %s\n", wt_kernels_active->name);
+
+    if (ranks) {
+        for(l = 0; l < nlens; ++l)
+            run_ranks(lens[l], count);
+        return sink == 42;
+    }
+
+    for(d = 0; d < sizeof(datasets) / sizeof(datasets[0]); ++d) {
+        if (only && strcmp(only, datasets[d].name)) continue;
+        for(l = 0; l < nlens; ++l)
+            run_dataset(&datasets[d], lens[l], count, aux);
+    }
+    return sink == 42;
+}
@@ -0,0 +1,231 @@
+/*
+ * Checks of the core library that replies can't show, linked against
+ * build/libwvltr_core.a like any program using it.
+ *
+ *   core_check    run every check and exit with 1 if any failed
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wvltr_core.h"
+
+static int failed;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("FAIL " __VA_ARGS__); \
+        printf("\n"); \
+        ++failed; \
+    } \
+} while (0)
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/*
+ * Allocator and batch queries
+ */
+
+// Blocks allocated through the library and not yet freed
+static long live_blocks;
+
+static void *_counting_malloc(size_t size) {
+    __atomic_add_fetch(&live_blocks, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void *_counting_calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&live_blocks, 1, __ATOMIC_RELAXED);
+    return calloc(count, size);
+}
+
+static void *_counting_realloc(void *ptr, size_t size) {
+    if (!ptr) __atomic_add_fetch(&live_blocks, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+}
+
+static void _counting_free(void *ptr) {
+    if (ptr) __atomic_sub_fetch(&live_blocks, 1, __ATOMIC_RELAXED);
+    free(ptr);
+}
+
+static int _compare_int32(const void *a, const void *b) {
+    int32_t x = *(const int32_t*)a, y = *(const int32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Answers q by scanning data, as wt_query_batch documents it
+static void _batch_expected(const int32_t *data, size_t n, wt_query *q, int32_t *scratch) {
+    size_t p, j = q->j < n ? q->j : n, c = 0;
+    q->found = 1;
+    q->result = 0;
+    switch (q->op) {
+    case WT_QUERY_ACCESS:
+        q->found = q->i < n;
+        q->result = q->found ? data[q->i] : 0;
+        break;
+    case WT_QUERY_RANK:
+        for(p = 0; p < q->i && p < n; ++p)
+            q->result += data[p] == q->x;
+        break;
+    case WT_QUERY_SELECT:
+        for(p = 0; p < n && c < q->i; ++p)
+            c += data[p] == q->x;
+        q->found = q->i && c == q->i;
+        q->result = q->found ? (int64_t)p - 1 : 0;
+        break;
+    case WT_QUERY_QUANTILE:
+        q->found = q->i < j && 0 < q->x && q->x <= (int64_t)(j - q->i);
+        if (q->found) {
+            memcpy(scratch, data + q->i, (j - q->i) * sizeof(int32_t));
+            qsort(scratch, j - q->i, sizeof(int32_t), _compare_int32);
+            q->result = scratch[q->x - 1];
+        }
+        break;
+    case WT_QUERY_RANGE_FREQ:
+    case WT_QUERY_RANGE_SUM:
+        for(p = q->i; p < j; ++p) {
+            if (q->x <= data[p] && data[p] < q->y)
+                q->result += q->op == WT_QUERY_RANGE_FREQ ? 1 : data[p];
+        }
+        break;
+    }
+}
+
+// Random queries of every kind, including indexes and values out of range,
+// must get the answers of a scan on any number of threads, and every block
+// the library allocates must be freed through the installed allocator
+static void check_batch(void) {
+    static const int threads[] = {1, 2, 7};
+    static const wt_allocator counting = { _counting_malloc, _counting_calloc, _counting_realloc, _counting_free };
+    size_t n = 20000, nq = 6000, p, t;
+    int32_t *data = malloc(n * sizeof(int32_t)), *work = malloc(n * sizeof(int32_t));
+    wt_query *queries = malloc(nq * sizeof(wt_query)), *expected = malloc(nq * sizeof(wt_query));
+
+    for(p = 0; p < n; ++p)
+        data[p] = rng() % 500 - 100;
+    for(p = 0; p < nq; ++p) {
+        wt_query *q = queries + p;
+        q->op = p % (WT_QUERY_RANGE_SUM + 1);
+        q->i = rng() % (n + 10);
+        q->j = q->i + rng() % 2000;
+        q->x = (int64_t)(rng() % 520) - 110;
+        q->y = q->x + rng() % 200;
+        if (q->op == WT_QUERY_SELECT)
+            q->i = rng() % 60;
+        else if (q->op == WT_QUERY_QUANTILE)
+            q->x = rng() % 2100;
+        else if (p % 50 == 0) {
+            // values past the 32-bit range
+            q->x = p % 100 ? INT64_MIN : (int64_t)INT32_MAX + 7;
+            q->y = INT64_MAX;
+        }
+        expected[p] = *q;
+        _batch_expected(data, n, expected + p, work);
+    }
+
+    wt_set_allocator(&counting);
+    memcpy(work, data, n * sizeof(int32_t));
+    wt_tree *tree = wt_new();
+    tree->flags = WT_FLAG_SUMS;
+    wt_build(tree, work, n);
+    CHECK(live_blocks > 0, "allocator: the tree was not allocated through it");
+
+    for(t = 0; t < sizeof(threads) / sizeof(threads[0]); ++t) {
+        wt_query_batch(tree, queries, nq, threads[t]);
+        for(p = 0; p < nq; ++p) {
+            const wt_query *q = queries + p, *e = expected + p;
+            CHECK(q->found == e->found && (!q->found || q->result == e->result),
+                "batch: threads %d op %d i %zu j %zu x %lld y %lld: found %d result %lld, expected found %d result %lld",
+                threads[t], q->op, q->i, q->j, (long long)q->x, (long long)q->y,
+                q->found, (long long)q->result, e->found, (long long)e->result);
+        }
+    }
+
+    wt_free(tree);
+    CHECK(live_blocks == 0, "allocator: %ld blocks left after wt_free", live_blocks);
+    free(data);
+    free(work);
+    free(queries);
+    free(expected);
+}
+
+/*
+ * Parallel build
+ */
+
+static int _same_fid(const fid *a, const fid *b) {
+    if (!a || !b) return a == b;
+    return a->n == b->n &&
+        !memcmp(a->bs, b->bs, FID_NWORDS(a, a->n) * sizeof(uint64_t)) &&
+        !memcmp(a->rd, b->rd, FID_NSUPERBLOCKS(a, a->n) * sizeof(uint64_t));
+}
+
+// Compares the bits, rank directories and prefix sums of every node
+static int _same_node(const wt_node *a, const wt_node *b) {
+    if (!a || !b) return a == b;
+    if (a->n != b->n || !_same_fid(a->fid, b->fid) || !a->sums != !b->sums)
+        return 0;
+    if (a->sums && memcmp(a->sums, b->sums, (a->n + 1) * sizeof(int64_t)))
+        return 0;
+    return _same_node(a->left, b->left) && _same_node(a->right, b->right);
+}
+
+static int _same_tree(const wt_tree *a, const wt_tree *b) {
+    if (!a || !b) return a == b;
+    return a->len == b->len && a->lower == b->lower && a->upper == b->upper &&
+        _same_node(a->root, b->root) && _same_tree(a->prev, b->prev);
+}
+
+// Sequences above the parallel threshold over a small, a wide and a skewed
+// alphabet, built with and without the options and with a few thread counts,
+// must give the same trees node by node as a single-threaded build
+static void check_parallel_build(void) {
+    static const int threads[] = {3, 8}, flags[] = {0, WT_FLAG_DISTINCT | WT_FLAG_SUMS};
+    size_t n = (1 << 17) + 12345, i, k, f, t;
+    int32_t *data = malloc(n * sizeof(int32_t)), *work = malloc(n * sizeof(int32_t));
+
+    for(k = 0; k < 3; ++k) {
+        for(i = 0; i < n; ++i) {
+            uint64_t r = rng();
+            data[i] = k == 0 ? (int32_t)(r % 7) : k == 1 ? (int32_t)r : (r % 5 ? 3 : (int32_t)(r % 100000));
+        }
+        for(f = 0; f < sizeof(flags) / sizeof(flags[0]); ++f) {
+            memcpy(work, data, n * sizeof(int32_t));
+            wt_set_build_threads(1);
+            wt_tree *serial = k == 0 ? wt_new_bounded(0, 6) : wt_new();
+            serial->flags = flags[f];
+            wt_build(serial, work, n);
+
+            for(t = 0; t < sizeof(threads) / sizeof(threads[0]); ++t) {
+                memcpy(work, data, n * sizeof(int32_t));
+                wt_set_build_threads(threads[t]);
+                wt_tree *parallel = k == 0 ? wt_new_bounded(0, 6) : wt_new();
+                parallel->flags = flags[f];
+                wt_build(parallel, work, n);
+                CHECK(_same_tree(serial, parallel), "parallel build: alphabet %zu flags %d threads %d", k, flags[f], threads[t]);
+                wt_free(parallel);
+            }
+            wt_free(serial);
+        }
+    }
+    wt_set_build_threads(1);
+    free(data);
+    free(work);
+}
+
+int main(int argc, char **argv) {
+    wt_kernels_init(NULL);
+    check_batch();
+    check_parallel_build();
+    printf("core checks, %d failed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,1038 @@
+/*
+ * In-process harness for the module.
+ *
+ * Links module.c against a local stand-in for the RedisModule_* function
+ * table: RedisModule_Init resolves every API through the GetApi pointer
+ * stored at the start of the context, so handing the module a fake context
+ * is enough to load it and run its commands without a server. Replies are
+ * recorded in memory as a tree and every command is timed end to end.
+ *
+ *   harness test                      run the built-in reply checks
+ *   harness bench [-n N] [-i iters] [-a sigma] [-s seed] [-c cache_bytes]
+ *                                     time each command end to end
+ *   harness                           read commands from stdin, one per line
+ */
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "redismodule.h"
+
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
+
+#define HARNESS_REPLY_STATUS 5
+#define HARNESS_MAX_DEPTH 64
+#define HARNESS_MAX_ARGS 64
+
+/*
+ * Replies
+ */
+
+typedef struct reply {
+    int type;
+    long long integer;
+    char *str;
+    size_t len;
+    // arrays: expected is -1 while the length is postponed
+    struct reply **elements;
+    long long expected;
+    size_t n, cap;
+} reply;
+
+struct RedisModuleCtx {
+    void *getapi;           // must stay first, see RedisModule_Init
+    reply *root;
+    int nreplies;
+    reply *open[HARNESS_MAX_DEPTH];
+    int depth;
+};
+
+static reply *_reply_new(int type) {
+    reply *r = calloc(1, sizeof(reply));
+    r->type = type;
+    return r;
+}
+
+static void _reply_free(reply *r) {
+    size_t i;
+    if (!r) return;
+    for(i = 0; i < r->n; ++i)
+        _reply_free(r->elements[i]);
+    free(r->elements);
+    free(r->str);
+    free(r);
+}
+
+static void _ctx_close_arrays(RedisModuleCtx *ctx) {
+    reply *top;
+    while (ctx->depth > 0) {
+        top = ctx->open[ctx->depth - 1];
+        if (top->expected < 0 || top->n < (size_t)top->expected)
+            break;
+        --ctx->depth;
+    }
+}
+
+static int _ctx_add(RedisModuleCtx *ctx, reply *r) {
+    if (ctx->depth > 0) {
+        reply *parent = ctx->open[ctx->depth - 1];
+        if (parent->n == parent->cap) {
+            parent->cap = parent->cap ? parent->cap << 1 : 8;
+            parent->elements = realloc(parent->elements, parent->cap * sizeof(reply*));
+        }
+        parent->elements[parent->n++] = r;
+    } else {
+        _reply_free(ctx->root);
+        ctx->root = r;
+        ++ctx->nreplies;
+    }
+
+    if (r->type == REDISMODULE_REPLY_ARRAY && r->expected != 0) {
+        if (ctx->depth == HARNESS_MAX_DEPTH) {
+            fprintf(stderr, "harness: replies nested too deep\n");
+            abort();
+        }
+        ctx->open[ctx->depth++] = r;
+    } else {
+        _ctx_close_arrays(ctx);
+    }
+    return REDISMODULE_OK;
+}
+
+static void _ctx_reset(RedisModuleCtx *ctx) {
+    _reply_free(ctx->root);
+    ctx->root = NULL;
+    ctx->nreplies = 0;
+    ctx->depth = 0;
+}
+
+// Compact single line form: 7, nil, OK, (error) ERR ..., "str", [a,b]
+static void _reply_format(FILE *out, const reply *r) {
+    size_t i;
+    if (!r) {
+        fputs("(no reply)", out);
+        return;
+    }
+    switch (r->type) {
+    case REDISMODULE_REPLY_INTEGER:
+        fprintf(out, "%lld", r->integer);
+        break;
+    case REDISMODULE_REPLY_NULL:
+        fputs("nil", out);
+        break;
+    case HARNESS_REPLY_STATUS:
+        fwrite(r->str, 1, r->len, out);
+        break;
+    case REDISMODULE_REPLY_ERROR:
+        fputs("(error) ", out);
+        fwrite(r->str, 1, r->len, out);
+        break;
+    case REDISMODULE_REPLY_STRING:
+        fputc('"', out);
+        fwrite(r->str, 1, r->len, out);
+        fputc('"', out);
+        break;
+    case REDISMODULE_REPLY_ARRAY:
+        fputc('[', out);
+        for(i = 0; i < r->n; ++i) {
+            if (i) fputc(',', out);
+            _reply_format(out, r->elements[i]);
+        }
+        fputc(']', out);
+        break;
+    }
+}
+
+static char *_reply_to_string(const reply *r) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    _reply_format(out, r);
+    fclose(out);
+    return buf;
+}
+
+/*
+ * Strings
+ */
+
+struct RedisModuleString {
+    size_t len;
+    char *ptr;
+};
+
+static RedisModuleString *_string_new(const char *ptr, size_t len) {
+    RedisModuleString *s = malloc(sizeof(RedisModuleString));
+    s->len = len;
+    s->ptr = malloc(len + 1);
+    memcpy(s->ptr, ptr, len);
+    s->ptr[len] = '\0';
+    return s;
+}
+
+static void _string_free(RedisModuleString *s) {
+    if (!s) return;
+    free(s->ptr);
+    free(s);
+}
+
+/*
+ * Keyspace
+ */
+
+struct RedisModuleType {
+    char name[10];
+    int encver;
+    RedisModuleTypeLoadFunc rdb_load;
+    RedisModuleTypeSaveFunc rdb_save;
+    RedisModuleTypeFreeFunc free;
+};
+
+typedef struct entry {
+    struct entry *next;
+    RedisModuleString *name;
+    int keytype;
+    RedisModuleType *type;
+    void *value;
+    // list keys, for RedisModule_Call("LRANGE")
+    RedisModuleString **items;
+    size_t nitems;
+} entry;
+
+struct RedisModuleKey {
+    RedisModuleCtx *ctx;
+    RedisModuleString *name;
+    int mode;
+};
+
+static entry *Keyspace;
+
+static entry *_entry_find(const char *name, size_t len, entry ***prev) {
+    entry **p = &Keyspace;
+    for(; *p; p = &(*p)->next) {
+        if ((*p)->name->len == len && memcmp((*p)->name->ptr, name, len) == 0)
+            break;
+    }
+    if (prev) *prev = p;
+    return *p;
+}
+
+static void _entry_clear(entry *e) {
+    size_t i;
+    if (e->type && e->value)
+        e->type->free(e->value);
+    for(i = 0; i < e->nitems; ++i)
+        _string_free(e->items[i]);
+    free(e->items);
+    e->type = NULL;
+    e->value = NULL;
+    e->items = NULL;
+    e->nitems = 0;
+    e->keytype = REDISMODULE_KEYTYPE_EMPTY;
+}
+
+static entry *_entry_create(const char *name, size_t len) {
+    entry **p, *e = _entry_find(name, len, &p);
+    if (e) return e;
+    e = calloc(1, sizeof(entry));
+    e->name = _string_new(name, len);
+    *p = e;
+    return e;
+}
+
+static void _entry_delete(const char *name, size_t len) {
+    entry **p, *e = _entry_find(name, len, &p);
+    if (!e) return;
+    *p = e->next;
+    _entry_clear(e);
+    _string_free(e->name);
+    free(e);
+}
+
+static void _keyspace_flush(void) {
+    while (Keyspace)
+        _entry_delete(Keyspace->name->ptr, Keyspace->name->len);
+}
+
+/*
+ * RDB stand-in: values are kept in a growing byte buffer
+ */
+
+struct RedisModuleIO {
+    char *buf;
+    size_t len, cap, pos;
+};
+
+static void _io_write(RedisModuleIO *io, const void *p, size_t len) {
+    while (io->cap < io->len + len) {
+        io->cap = io->cap ? io->cap << 1 : 256;
+        io->buf = realloc(io->buf, io->cap);
+    }
+    memcpy(io->buf + io->len, p, len);
+    io->len += len;
+}
+
+static void _io_read(RedisModuleIO *io, void *p, size_t len) {
+    if (io->len < io->pos + len) {
+        fprintf(stderr, "harness: rdb load past the end of the saved value\n");
+        abort();
+    }
+    memcpy(p, io->buf + io->pos, len);
+    io->pos += len;
+}
+
+/*
+ * RedisModule_* implementations
+ */
+
+typedef struct command {
+    struct command *next;
+    char *name;
+    RedisModuleCmdFunc func;
+} command;
+
+static command *Commands;
+
+static void *H_Alloc(size_t bytes) { return malloc(bytes); }
+static void *H_Calloc(size_t nmemb, size_t size) { return calloc(nmemb, size); }
+static void *H_Realloc(void *ptr, size_t bytes) { return realloc(ptr, bytes); }
+static void H_Free(void *ptr) { free(ptr); }
+static char *H_Strdup(const char *str) { return strdup(str); }
+
+static int H_CreateCommand(RedisModuleCtx *ctx, const char *name, RedisModuleCmdFunc cmdfunc,
+        const char *strflags, int firstkey, int lastkey, int keystep) {
+    command *c = calloc(1, sizeof(command));
+    char *p;
+    c->name = strdup(name);
+    for(p = c->name; *p; ++p)
+        *p = tolower((unsigned char)*p);
+    c->func = cmdfunc;
+    c->next = Commands;
+    Commands = c;
+    return REDISMODULE_OK;
+}
+
+static int H_SetModuleAttribs(RedisModuleCtx *ctx, const char *name, int ver, int apiver) {
+    return REDISMODULE_OK;
+}
+
+static RedisModuleType *H_CreateDataType(RedisModuleCtx *ctx, const char *name, int encver,
+        RedisModuleTypeLoadFunc rdb_load, RedisModuleTypeSaveFunc rdb_save,
+        RedisModuleTypeRewriteFunc aof_rewrite, RedisModuleTypeDigestFunc digest,
+        RedisModuleTypeFreeFunc free_func) {
+    RedisModuleType *type = calloc(1, sizeof(RedisModuleType));
+    strncpy(type->name, name, sizeof(type->name) - 1);
+    type->encver = encver;
+    type->rdb_load = rdb_load;
+    type->rdb_save = rdb_save;
+    type->free = free_func;
+    return type;
+}
+
+static int H_ReplyWithError(RedisModuleCtx *ctx, const char *err) {
+    reply *r = _reply_new(REDISMODULE_REPLY_ERROR);
+    r->len = strlen(err);
+    r->str = strdup(err);
+    return _ctx_add(ctx, r);
+}
+
+static int H_WrongArity(RedisModuleCtx *ctx) {
+    return H_ReplyWithError(ctx, "ERR wrong number of arguments");
+}
+
+static int H_ReplyWithLongLong(RedisModuleCtx *ctx, long long ll) {
+    reply *r = _reply_new(REDISMODULE_REPLY_INTEGER);
+    r->integer = ll;
+    return _ctx_add(ctx, r);
+}
+
+static int H_ReplyWithSimpleString(RedisModuleCtx *ctx, const char *msg) {
+    reply *r = _reply_new(HARNESS_REPLY_STATUS);
+    r->len = strlen(msg);
+    r->str = strdup(msg);
+    return _ctx_add(ctx, r);
+}
+
+static int H_ReplyWithStringBuffer(RedisModuleCtx *ctx, const char *buf, size_t len) {
+    reply *r = _reply_new(REDISMODULE_REPLY_STRING);
+    r->len = len;
+    r->str = malloc(len + 1);
+    memcpy(r->str, buf, len);
+    r->str[len] = '\0';
+    return _ctx_add(ctx, r);
+}
+
+static int H_ReplyWithString(RedisModuleCtx *ctx, RedisModuleString *str) {
+    return H_ReplyWithStringBuffer(ctx, str->ptr, str->len);
+}
+
+static int H_ReplyWithNull(RedisModuleCtx *ctx) {
+    return _ctx_add(ctx, _reply_new(REDISMODULE_REPLY_NULL));
+}
+
+static int H_ReplyWithDouble(RedisModuleCtx *ctx, double d) {
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%.17g", d);
+    return H_ReplyWithStringBuffer(ctx, buf, len);
+}
+
+static int H_ReplyWithArray(RedisModuleCtx *ctx, long len) {
+    reply *r = _reply_new(REDISMODULE_REPLY_ARRAY);
+    r->expected = len;
+    return _ctx_add(ctx, r);
+}
+
+static void H_ReplySetArrayLength(RedisModuleCtx *ctx, long len) {
+    int d;
+    for(d = ctx->depth - 1; d >= 0; --d) {
+        if (ctx->open[d]->expected < 0) {
+            ctx->open[d]->expected = len;
+            _ctx_close_arrays(ctx);
+            return;
+        }
+    }
+    fprintf(stderr, "harness: RedisModule_ReplySetArrayLength without a postponed array\n");
+    abort();
+}
+
+static void *H_OpenKey(RedisModuleCtx *ctx, RedisModuleString *keyname, int mode) {
+    RedisModuleKey *key = calloc(1, sizeof(RedisModuleKey));
+    key->ctx = ctx;
+    key->name = keyname;
+    key->mode = mode;
+    return key;
+}
+
+static void H_CloseKey(RedisModuleKey *key) {
+    entry *e;
+    if (!key) return;
+    // keys opened for writing but never given a value do not exist
+    e = _entry_find(key->name->ptr, key->name->len, NULL);
+    if (e && e->keytype == REDISMODULE_KEYTYPE_EMPTY)
+        _entry_delete(key->name->ptr, key->name->len);
+    free(key);
+}
+
+static int H_KeyType(RedisModuleKey *key) {
+    entry *e;
+    if (!key) return REDISMODULE_KEYTYPE_EMPTY;
+    e = _entry_find(key->name->ptr, key->name->len, NULL);
+    return e ? e->keytype : REDISMODULE_KEYTYPE_EMPTY;
+}
+
+static int H_DeleteKey(RedisModuleKey *key) {
+    _entry_delete(key->name->ptr, key->name->len);
+    return REDISMODULE_OK;
+}
+
+static int H_ModuleTypeSetValue(RedisModuleKey *key, RedisModuleType *mt, void *value) {
+    entry *e;
+    if (!(key->mode & REDISMODULE_WRITE)) return REDISMODULE_ERR;
+    e = _entry_create(key->name->ptr, key->name->len);
+    _entry_clear(e);
+    e->keytype = REDISMODULE_KEYTYPE_MODULE;
+    e->type = mt;
+    e->value = value;
+    return REDISMODULE_OK;
+}
+
+static RedisModuleType *H_ModuleTypeGetType(RedisModuleKey *key) {
+    entry *e = _entry_find(key->name->ptr, key->name->len, NULL);
+    return e ? e->type : NULL;
+}
+
+static void *H_ModuleTypeGetValue(RedisModuleKey *key) {
+    entry *e = _entry_find(key->name->ptr, key->name->len, NULL);
+    return e ? e->value : NULL;
+}
+
+static RedisModuleString *H_CreateString(RedisModuleCtx *ctx, const char *ptr, size_t len) {
+    return _string_new(ptr, len);
+}
+
+static RedisModuleString *H_CreateStringFromLongLong(RedisModuleCtx *ctx, long long ll) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%lld", ll);
+    return _string_new(buf, len);
+}
+
+static void H_FreeString(RedisModuleCtx *ctx, RedisModuleString *str) {
+    _string_free(str);
+}
+
+static const char *H_StringPtrLen(RedisModuleString *str, size_t *len) {
+    if (len) *len = str->len;
+    return str->ptr;
+}
+
+static int H_StringToLongLong(RedisModuleString *str, long long *ll) {
+    char *end;
+    if (str->len == 0 || isspace((unsigned char)str->ptr[0])) return REDISMODULE_ERR;
+    *ll = strtoll(str->ptr, &end, 10);
+    return end == str->ptr + str->len ? REDISMODULE_OK : REDISMODULE_ERR;
+}
+
+static int H_StringToDouble(RedisModuleString *str, double *d) {
+    char *end;
+    if (str->len == 0 || isspace((unsigned char)str->ptr[0])) return REDISMODULE_ERR;
+    *d = strtod(str->ptr, &end);
+    return end == str->ptr + str->len ? REDISMODULE_OK : REDISMODULE_ERR;
+}
+
+static int H_ReplicateVerbatim(RedisModuleCtx *ctx) {
+    return REDISMODULE_OK;
+}
+
+static long long H_Milliseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void H_Log(RedisModuleCtx *ctx, const char *level, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "harness: [%s] ", level);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+static void H_EmitAOF(RedisModuleIO *io, const char *cmdname, const char *fmt, ...) {
+}
+
+static void H_SaveUnsigned(RedisModuleIO *io, uint64_t value) { _io_write(io, &value, sizeof(value)); }
+static void H_SaveSigned(RedisModuleIO *io, int64_t value) { _io_write(io, &value, sizeof(value)); }
+static void H_SaveDouble(RedisModuleIO *io, double value) { _io_write(io, &value, sizeof(value)); }
+
+static void H_SaveStringBuffer(RedisModuleIO *io, const char *str, size_t len) {
+    uint64_t l = len;
+    _io_write(io, &l, sizeof(l));
+    _io_write(io, str, len);
+}
+
+static uint64_t H_LoadUnsigned(RedisModuleIO *io) { uint64_t v; _io_read(io, &v, sizeof(v)); return v; }
+static int64_t H_LoadSigned(RedisModuleIO *io) { int64_t v; _io_read(io, &v, sizeof(v)); return v; }
+static double H_LoadDouble(RedisModuleIO *io) { double v; _io_read(io, &v, sizeof(v)); return v; }
+
+static char *H_LoadStringBuffer(RedisModuleIO *io, size_t *lenptr) {
+    uint64_t l;
+    char *buf;
+    _io_read(io, &l, sizeof(l));
+    buf = malloc(l + 1);
+    _io_read(io, buf, l);
+    buf[l] = '\0';
+    if (lenptr) *lenptr = l;
+    return buf;
+}
+
+// Only LRANGE key 0 -1 is served, which is what wvltr.lbuild issues
+struct RedisModuleCallReply {
+    int type;
+    const char *str;
+    size_t len;
+    struct RedisModuleCallReply *elements;
+};
+
+static RedisModuleCallReply *H_Call(RedisModuleCtx *ctx, const char *cmdname, const char *fmt, ...) {
+    RedisModuleCallReply *reply = calloc(1, sizeof(RedisModuleCallReply));
+    RedisModuleString *keyname;
+    entry *e;
+    size_t i;
+    va_list ap;
+
+    if (strcasecmp(cmdname, "LRANGE") || strcmp(fmt, "scc")) {
+        reply->type = REDISMODULE_REPLY_ERROR;
+        reply->str = "ERR command not available in the harness";
+        reply->len = strlen(reply->str);
+        return reply;
+    }
+
+    va_start(ap, fmt);
+    keyname = va_arg(ap, RedisModuleString*);
+    va_end(ap);
+
+    reply->type = REDISMODULE_REPLY_ARRAY;
+    e = _entry_find(keyname->ptr, keyname->len, NULL);
+    if (e && e->keytype == REDISMODULE_KEYTYPE_LIST) {
+        reply->len = e->nitems;
+        reply->elements = calloc(e->nitems + 1, sizeof(RedisModuleCallReply));
+        for(i = 0; i < e->nitems; ++i) {
+            reply->elements[i].type = REDISMODULE_REPLY_STRING;
+            reply->elements[i].str = e->items[i]->ptr;
+            reply->elements[i].len = e->items[i]->len;
+        }
+    }
+    return reply;
+}
+
+static int H_CallReplyType(RedisModuleCallReply *reply) {
+    return reply ? reply->type : REDISMODULE_REPLY_UNKNOWN;
+}
+
+static size_t H_CallReplyLength(RedisModuleCallReply *reply) {
+    return reply->len;
+}
+
+static RedisModuleCallReply *H_CallReplyArrayElement(RedisModuleCallReply *reply, size_t idx) {
+    return reply->type == REDISMODULE_REPLY_ARRAY && idx < reply->len ? &reply->elements[idx] : NULL;
+}
+
+static const char *H_CallReplyStringPtr(RedisModuleCallReply *reply, size_t *len) {
+    if (len) *len = reply->len;
+    return reply->str;
+}
+
+static void H_FreeCallReply(RedisModuleCallReply *reply) {
+    if (!reply) return;
+    free(reply->elements);
+    free(reply);
+}
+
+static void H_Unsupported(void) {
+    fprintf(stderr, "harness: the module called a RedisModule API the harness does not provide\n");
+    abort();
+}
+
+static struct {
+    const char *name;
+    void *func;
+} Api[] = {
+#define API(name) { "RedisModule_" #name, (void*)H_##name }
+    API(Alloc), API(Calloc), API(Realloc), API(Free), API(Strdup),
+    API(CreateCommand), API(SetModuleAttribs), API(CreateDataType),
+    API(WrongArity), API(ReplyWithLongLong), API(ReplyWithError), API(ReplyWithSimpleString),
+    API(ReplyWithArray), API(ReplySetArrayLength), API(ReplyWithStringBuffer),
+    API(ReplyWithString), API(ReplyWithNull), API(ReplyWithDouble),
+    API(OpenKey), API(CloseKey), API(KeyType), API(DeleteKey),
+    API(ModuleTypeSetValue), API(ModuleTypeGetType), API(ModuleTypeGetValue),
+    API(CreateString), API(CreateStringFromLongLong), API(FreeString), API(StringPtrLen),
+    API(StringToLongLong), API(StringToDouble),
+    API(ReplicateVerbatim), API(Milliseconds), API(Log), API(EmitAOF),
+    API(SaveUnsigned), API(SaveSigned), API(SaveDouble), API(SaveStringBuffer),
+    API(LoadUnsigned), API(LoadSigned), API(LoadDouble), API(LoadStringBuffer),
+    API(Call), API(CallReplyType), API(CallReplyLength), API(CallReplyArrayElement),
+    API(CallReplyStringPtr), API(FreeCallReply),
+#undef API
+};
+
+static int H_GetApi(const char *name, void *ptr) {
+    size_t i;
+    for(i = 0; i < sizeof(Api) / sizeof(Api[0]); ++i) {
+        if (!strcmp(Api[i].name, name)) {
+            *(void**)ptr = Api[i].func;
+            return REDISMODULE_OK;
+        }
+    }
+    // abort loudly if the module ever calls an API this file lacks
+    *(void**)ptr = (void*)H_Unsupported;
+    return REDISMODULE_ERR;
+}
+
+/*
+ * Running commands
+ */
+
+static RedisModuleCtx Ctx = { (void*)H_GetApi };
+
+static uint64_t _clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int _harness_load(const char *const *args, int nargs) {
+    RedisModuleString *argv[HARNESS_MAX_ARGS];
+    int i, ret;
+    for(i = 0; i < nargs; ++i)
+        argv[i] = _string_new(args[i], strlen(args[i]));
+    ret = RedisModule_OnLoad(&Ctx, argv, nargs);
+    for(i = 0; i < nargs; ++i)
+        _string_free(argv[i]);
+    return ret;
+}
+
+// Saves and reloads every module value through its rdb callbacks
+static void _harness_reload(void) {
+    RedisModuleIO io;
+    entry *e;
+    void *value;
+    for(e = Keyspace; e; e = e->next) {
+        if (e->keytype != REDISMODULE_KEYTYPE_MODULE)
+            continue;
+        memset(&io, 0, sizeof(io));
+        e->type->rdb_save(&io, e->value);
+        value = e->type->rdb_load(&io, e->type->encver);
+        if (io.pos != io.len) {
+            fprintf(stderr, "harness: %s loaded %zu of %zu saved bytes\n", e->name->ptr, io.pos, io.len);
+            abort();
+        }
+        e->type->free(e->value);
+        e->value = value;
+        free(io.buf);
+    }
+}
+
+// Harness builtins: RPUSH key v..., DEL key, FLUSHALL, DEBUG RELOAD
+static int _harness_builtin(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    const char *name = argv[0]->ptr;
+    entry *e;
+    int i;
+
+    if (!strcasecmp(name, "rpush") && argc >= 3) {
+        e = _entry_find(argv[1]->ptr, argv[1]->len, NULL);
+        if (e && e->keytype != REDISMODULE_KEYTYPE_LIST)
+            return H_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        e = _entry_create(argv[1]->ptr, argv[1]->len);
+        e->keytype = REDISMODULE_KEYTYPE_LIST;
+        e->items = realloc(e->items, (e->nitems + argc - 2) * sizeof(RedisModuleString*));
+        for(i = 2; i < argc; ++i)
+            e->items[e->nitems++] = _string_new(argv[i]->ptr, argv[i]->len);
+        return H_ReplyWithLongLong(ctx, e->nitems);
+    }
+    if (!strcasecmp(name, "del") && argc == 2) {
+        e = _entry_find(argv[1]->ptr, argv[1]->len, NULL);
+        _entry_delete(argv[1]->ptr, argv[1]->len);
+        return H_ReplyWithLongLong(ctx, e != NULL);
+    }
+    if (!strcasecmp(name, "flushall") && argc == 1) {
+        _keyspace_flush();
+        return H_ReplyWithSimpleString(ctx, "OK");
+    }
+    if (!strcasecmp(name, "debug") && argc == 2 && !strcasecmp(argv[1]->ptr, "reload")) {
+        _harness_reload();
+        return H_ReplyWithSimpleString(ctx, "OK");
+    }
+    return H_ReplyWithError(ctx, "ERR unknown command");
+}
+
+/*
+ * Runs one command and returns its reply, which stays valid until the next
+ * call. The elapsed time covers argument lookup, the handler and its reply.
+ */
+static const reply *harness_run(RedisModuleString **argv, int argc, uint64_t *ns) {
+    command *c;
+    char name[64];
+    size_t i;
+    int ret;
+    uint64_t start = _clock_ns();
+
+    _ctx_reset(&Ctx);
+    for(i = 0; i < argv[0]->len && i < sizeof(name) - 1; ++i)
+        name[i] = tolower((unsigned char)argv[0]->ptr[i]);
+    name[i] = '\0';
+
+    for(c = Commands; c; c = c->next) {
+        if (!strcmp(c->name, name))
+            break;
+    }
+    ret = c ? c->func(&Ctx, argv, argc) : _harness_builtin(&Ctx, argv, argc);
+
+    if (ns) *ns = _clock_ns() - start;
+
+    // a handler that fails without replying leaves the client hanging
+    if (ret == REDISMODULE_ERR && !Ctx.root)
+        H_ReplyWithError(&Ctx, "(handler returned REDISMODULE_ERR without a reply)");
+    if (Ctx.nreplies > 1)
+        fprintf(stderr, "harness: %s replied %d times\n", name, Ctx.nreplies);
+    if (Ctx.depth)
+        fprintf(stderr, "harness: %s left %d arrays unfinished\n", name, Ctx.depth);
+    return Ctx.root;
+}
+
+// Splits a line on whitespace; "\xHH" escapes let tests pass binary values
+static int _split(const char *line, RedisModuleString **argv) {
+    char buf[1 << 16];
+    int argc = 0;
+    size_t len;
+    const char *p = line;
+
+    while (*p) {
+        while (isspace((unsigned char)*p)) ++p;
+        if (!*p) break;
+        len = 0;
+        while (*p && !isspace((unsigned char)*p) && len < sizeof(buf)) {
+            if (p[0] == '\\' && p[1] == 'x' && isxdigit((unsigned char)p[2]) && isxdigit((unsigned char)p[3])) {
+                char hex[3] = { p[2], p[3], '\0' };
+                buf[len++] = strtol(hex, NULL, 16);
+                p += 4;
+            } else {
+                buf[len++] = *p++;
+            }
+        }
+        if (argc == HARNESS_MAX_ARGS) break;
+        argv[argc++] = _string_new(buf, len);
+    }
+    return argc;
+}
+
+static const reply *_run_line(const char *line, uint64_t *ns) {
+    RedisModuleString *argv[HARNESS_MAX_ARGS];
+    int i, argc = _split(line, argv);
+    const reply *r;
+    if (argc == 0) return NULL;
+    r = harness_run(argv, argc, ns);
+    for(i = 0; i < argc; ++i)
+        _string_free(argv[i]);
+    return r;
+}
+
+/*
+ * Built-in checks
+ */
+
+// S = 3 3 9 1 2 1 7 6 4 8 9 4 3 7 5 9 2 7 3 5 1 3, as wvltr.set bytes
+#define S_BYTES \
+    "\\x00\\x00\\x00\\x03\\x00\\x00\\x00\\x03\\x00\\x00\\x00\\x09\\x00\\x00\\x00\\x01" \
+    "\\x00\\x00\\x00\\x02\\x00\\x00\\x00\\x01\\x00\\x00\\x00\\x07\\x00\\x00\\x00\\x06" \
+    "\\x00\\x00\\x00\\x04\\x00\\x00\\x00\\x08\\x00\\x00\\x00\\x09\\x00\\x00\\x00\\x04" \
+    "\\x00\\x00\\x00\\x03\\x00\\x00\\x00\\x07\\x00\\x00\\x00\\x05\\x00\\x00\\x00\\x09" \
+    "\\x00\\x00\\x00\\x02\\x00\\x00\\x00\\x07\\x00\\x00\\x00\\x03\\x00\\x00\\x00\\x05" \
+    "\\x00\\x00\\x00\\x01\\x00\\x00\\x00\\x03"
+
+static const struct {
+    const char *command, *expected;
+} Checks[] = {
+    { "wvltr.set s " S_BYTES, "OK" },
+    { "wvltr.access s 2", "9" },
+    { "wvltr.access s 22", "nil" },
+    { "wvltr.access missing 0", "nil" },
+    { "wvltr.getrange s 0 5", "[3,3,9,1,2]" },
+    { "wvltr.rank s 3 14", "3" },
+    { "wvltr.select s 3 4", "18" },
+    { "wvltr.quantile s 6 16 6", "7" },
+    { "wvltr.quantile s 6 16 6 APPROX 30", "[4,7]" },
+    { "wvltr.topk s 0 22 1", "[[3,5]]" },
+    { "wvltr.intersect s 0 8 12 22", "[[1,2,1],[2,1,1],[3,2,3],[7,1,2],[9,1,1]]" },
+    { "wvltr.nextpos s 3 2", "12" },
+    { "wvltr.prevpos s 3 11", "1" },
+    { "wvltr.positions s 3 1 22 1 2", "[3,[12,18]]" },
+    { "wvltr.positions s 3 0 9223372036854775807 0 9223372036854775807", "[0,[0,1,12,18,21]]" },
+    { "wvltr.rank s", "(error) ERR wrong number of arguments" },
+    { "wvltr.bench s sort 10", "(error) ERR unknown operation" },
+    { "wvltr.bench missing topk 10", "nil" },
+    { "wvltr.info missing", "nil" },
+    { "rpush l 5 1 5 2", "4" },
+    { "wvltr.rank l 5 4", "(error) " REDISMODULE_ERRORMSG_WRONGTYPE },
+    { "wvltr.set d " S_BYTES " DISTINCT SUMS", "OK" },
+    { "wvltr.distinct d 0 22", "9" },
+    { "wvltr.distinct d 2 9", "6" },
+    { "wvltr.distinct s 0 22", "(error) ERR the wavelet tree was not built with DISTINCT" },
+    { "wvltr.rangesum d 0 8 2 7", "14" },
+    { "wvltr.kthsum d 0 8 3", "4" },
+    { "wvltr.rangesum s 0 22 0 10", "(error) ERR the wavelet tree was not built with SUMS" },
+    { "wvltr.rangehist s 0 22 1 4 8 10", "[10,8,4]" },
+    { "wvltr.rangefreq s 0 8 3 6", "3" },
+    { "wvltr.rangefreq s 0 8 3 6 APPROX 2", "[0,8]" },
+    { "wvltr.slidingquantile s 0 10 4 3 2", "[3,1,6]" },
+    { "wvltr.slidingtopk s 0 10 4 3 1", "[[[3,2]],[[1,2]],[[7,1]]]" },
+    { "wvltr.cache SIZE 100000", "OK" },
+    { "wvltr.cache RESET", "OK" },
+    { "wvltr.topk s 0 22 1", "[[3,5]]" },
+    { "wvltr.topk s 0 22 1", "[[3,5]]" },
+    { "wvltr.cache INFO", "[capacity,100000,used,191,entries,1,hits,1,misses,1,evictions,0,generation,2]" },
+    { "wvltr.mquantile s 4 0 5 12 22", "2" },
+    { "wvltr.mtopk s 2 0 5 12 22", "[[3,5],[2,2]]" },
+    { "wvltr.mrangefreq s 1 3 -5 10", "5" },
+    { "wvltr.topk s 0 22 2 MAXWORK 1000", "[[[3,5],[9,3]],0]" },
+    { "wvltr.topk s 0 22 2 MAXWORK 3", "[[],1]" },
+    { "wvltr.rangelist s 0 22 2 4 MAXWORK 3", "[[[3,5],[2,2]],1]" },
+    { "wvltr.rangemink s 0 22 3 MAXWORK 2", "[[],1]" },
+    { "wvltr.topk s 0 22 1 TIMEOUT 9223372036854775807", "[[[3,5]],0]" },
+    { "wvltr.rangeheavy s 0 22 4", "[[3,5]]" },
+    { "wvltr.rangeheavy s 0 2 0.5", "[[3,2]]" },
+    { "wvltr.rangeheavy s 20 1000000 0.5", "[[1,1],[3,1]]" },
+    { "wvltr.pointbuild g 5 2 1 7 3 4 8 1 3 9 6 5 2 3 4 2147483647 7 -2147483648", "OK" },
+    { "wvltr.pointbuild h 1 2147483648", "(error) ERR coordinates must be 32-bit integers" },
+    { "wvltr.pointcount g 2 7 3 8", "3" },
+    { "wvltr.pointcount g 0 10 -2147483648 2147483648", "9" },
+    { "wvltr.pointrange g 2 7 3 8 1 5", "[0,[[3,4],[6,5]]]" },
+    { "wvltr.pointnearest g 1 9 6 3", "[[1,7],[6,5],[3,4]]" },
+    { "wvltr.pointnearest g 0 10 9223372036854775807 2", "[[4,2147483647],[3,9]]" },
+    { "wvltr.fmbuild f abracadabra", "OK" },
+    { "wvltr.fmcount f abra", "2" },
+    { "wvltr.fmlocate f a", "[0,3,5,7,10]" },
+    { "wvltr.fmlocate f a 2", "[7,10]" },
+    { "debug reload", "OK" },
+    { "wvltr.quantile s 6 16 6", "7" },
+    { "wvltr.pointrange g 0 10 5 2147483648 0 10", "[0,[[6,5],[1,7],[3,9],[4,2147483647]]]" },
+    { "wvltr.fmlocate f bra", "[1,8]" },
+};
+
+static int harness_test(void) {
+    size_t i;
+    int failed = 0;
+    char *got;
+    const reply *r;
+
+    for(i = 0; i < sizeof(Checks) / sizeof(Checks[0]); ++i) {
+        r = _run_line(Checks[i].command, NULL);
+        got = _reply_to_string(r);
+        if (strcmp(got, Checks[i].expected)) {
+            printf("FAIL %s\n  expected %s\n  got      %s\n", Checks[i].command, Checks[i].expected, got);
+            ++failed;
+        }
+        free(got);
+    }
+    printf("%zu checks, %d failed\n", sizeof(Checks) / sizeof(Checks[0]), failed);
+    return failed ? 1 : 0;
+}
+
+/*
+ * End-to-end timings
+ */
+
+static int _cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long long RandomState;
+
+static unsigned long long _random(void) {
+    // splitmix64
+    unsigned long long z = (RandomState += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Each %r is replaced by a random index below n, each %v by a random value
+static const char *BenchCommands[] = {
+    "wvltr.access b %r",
+    "wvltr.rank b %v %r",
+    "wvltr.select b %v 1",
+    "wvltr.quantile b 0 %r 1",
+    "wvltr.rangefreq b 0 %r %v %v",
+    "wvltr.topk b 0 %r 10",
+    "wvltr.rangelist b 0 %r %v %v",
+    "wvltr.nextvalue b 0 %r %v %v",
+};
+
+static int harness_bench(size_t n, size_t iterations, size_t sigma) {
+    RedisModuleString *argv[HARNESS_MAX_ARGS];
+    char line[256], *p;
+    const char *q;
+    uint64_t *samples = malloc(iterations * sizeof(uint64_t)), build_ns, total;
+    size_t i, c, k;
+    int argc;
+    uint32_t v;
+    char *buf = malloc(n * 4);
+
+    // bytes are kept below 0x80 so wvltr.set decodes them exactly
+    for(i = 0; i < n; ++i) {
+        v = _random() % sigma;
+        buf[4*i+2] = (v >> 7) & 0x7f;
+        buf[4*i+3] = v & 0x7f;
+        buf[4*i+1] = buf[4*i] = 0;
+    }
+    argv[0] = _string_new("wvltr.set", 9);
+    argv[1] = _string_new("b", 1);
+    argv[2] = _string_new(buf, n * 4);
+    harness_run(argv, 3, &build_ns);
+    for(i = 0; i < 3; ++i)
+        _string_free(argv[i]);
+    free(buf);
+    printf("wvltr.set n=%zu sigma=%zu: %.3f ms\n", n, sigma, build_ns / 1e6);
+    printf("%-34s %12s %10s %10s %10s %10s\n", "command", "ops/s", "mean ns", "p50 ns", "p90 ns", "p99 ns");
+
+    for(c = 0; c < sizeof(BenchCommands) / sizeof(BenchCommands[0]); ++c) {
+        total = 0;
+        for(k = 0; k < iterations; ++k) {
+            p = line;
+            for(q = BenchCommands[c]; *q && p < line + sizeof(line) - 24; ++q) {
+                if (q[0] == '%' && q[1] == 'r') {
+                    p += sprintf(p, "%llu", _random() % n);
+                    ++q;
+                } else if (q[0] == '%' && q[1] == 'v') {
+                    p += sprintf(p, "%llu", _random() % sigma);
+                    ++q;
+                } else {
+                    *p++ = *q;
+                }
+            }
+            *p = '\0';
+            argc = _split(line, argv);
+            harness_run(argv, argc, &samples[k]);
+            for(i = 0; i < argc; ++i)
+                _string_free(argv[i]);
+            total += samples[k];
+        }
+        qsort(samples, iterations, sizeof(uint64_t), _cmp_u64);
+        printf("%-34s %12.0f %10.0f %10llu %10llu %10llu\n", BenchCommands[c],
+            total ? iterations * 1e9 / total : 0.0, (double)total / iterations,
+            (unsigned long long)samples[iterations / 2],
+            (unsigned long long)samples[iterations * 9 / 10],
+            (unsigned long long)samples[iterations * 99 / 100]);
+        fflush(stdout);
+    }
+
+    free(samples);
+    return 0;
+}
+
+static int harness_repl(void) {
+    char line[1 << 16];
+    char *out;
+    uint64_t ns;
+    const reply *r;
+    while (fgets(line, sizeof(line), stdin)) {
+        if (line[0] == '#') continue;
+        r = _run_line(line, &ns);
+        if (!r) continue;
+        out = _reply_to_string(r);
+        printf("%s\t(%llu ns)\n", out, (unsigned long long)ns);
+        free(out);
+    }
+    return 0;
+}
+
+static void _usage(void) {
+    fprintf(stderr,
+        "usage: harness [test | bench [-n N] [-i iterations] [-a sigma] [-s seed] [-c cache_bytes]] [-k kernels]\n"
+        "       with no mode, commands are read from stdin one per line\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    size_t n = 100000, iterations = 10000, sigma = 1 << 14;
+    const char *cache = "0", *kernels = "auto";
+    const char *args[4];
+    int i, ret = 0;
+
+    RandomState = 1;
+    for(i = 2; i < argc; ++i) {
+        if (i + 1 >= argc) _usage();
+        if (!strcmp(argv[i], "-n")) n = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-i")) iterations = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-a")) sigma = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-s")) RandomState = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-c")) cache = argv[++i];
+        else if (!strcmp(argv[i], "-k")) kernels = argv[++i];
+        else _usage();
+    }
+    if (n == 0 || iterations == 0 || sigma == 0 || sigma > (1 << 14)) _usage();
+
+    args[0] = "CACHE";
+    args[1] = cache;
+    args[2] = "KERNELS";
+    args[3] = kernels;
+    if (_harness_load(args, 4) != REDISMODULE_OK) {
+        fprintf(stderr, "harness: RedisModule_OnLoad failed\n");
+        return 1;
+    }
+
+    if (argc < 2) ret = harness_repl();
+    else if (!strcmp(argv[1], "test")) ret = harness_test();
+    else if (!strcmp(argv[1], "bench")) ret = harness_bench(n, iterations, sigma);
+    else _usage();
+
+    _ctx_reset(&Ctx);
+    _keyspace_flush();
+    return ret;
+}
@@ -0,0 +1,35 @@
+#ifdef WT_CORE
+
+#include <stdlib.h>
+
+// The C library functions, taken before common.h renames them
+static void *_libc_malloc(size_t size) { return malloc(size); }
+static void *_libc_calloc(size_t count, size_t size) { return calloc(count, size); }
+static void *_libc_realloc(void *ptr, size_t size) { return realloc(ptr, size); }
+static void _libc_free(void *ptr) { free(ptr); }
+
+#include "common.h"
+
+static wt_allocator Allocator = { _libc_malloc, _libc_calloc, _libc_realloc, _libc_free };
+
+void wt_set_allocator(const wt_allocator *allocator) {
+    Allocator = *allocator;
+}
+
+void *wt_mem_malloc(size_t size) {
+    return Allocator.malloc_fn(size);
+}
+
+void *wt_mem_calloc(size_t count, size_t size) {
+    return Allocator.calloc_fn(count, size);
+}
+
+void *wt_mem_realloc(void *ptr, size_t size) {
+    return Allocator.realloc_fn(ptr, size);
+}
+
+void wt_mem_free(void *ptr) {
+    Allocator.free_fn(ptr);
+}
+
+#endif
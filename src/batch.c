@@ -0,0 +1,104 @@
+#include <pthread.h>
+
+#include "batch.h"
+
+#define WT_BATCH_MAX_THREADS 64
+
+// Number of elements of [i, j) less than v, for v up to 2^31
+static int64_t _wt_batch_less(const wt_tree *tree, size_t i, size_t j, int64_t v) {
+    if (v <= INT32_MAX)
+        return wt_range_less(tree, i, j, v);
+    if (tree->len < j) j = tree->len;
+    return i < j ? j - i : 0;
+}
+
+static void _wt_query(const wt_tree *tree, wt_query *q) {
+    int32_t value;
+    int64_t lo, hi;
+    int res;
+    q->found = 1;
+    q->result = 0;
+    // Values outside the 32-bit range never occur, and quantiles past the
+    // length of the range don't exist
+    if ((q->op == WT_QUERY_RANK || q->op == WT_QUERY_SELECT) && (q->x < INT32_MIN || INT32_MAX < q->x)) {
+        q->found = q->op == WT_QUERY_RANK;
+        return;
+    }
+    if (q->op == WT_QUERY_QUANTILE && (q->x < 1 || q->j <= q->i ||
+            (int64_t)((tree->len < q->j ? tree->len : q->j) - q->i) < q->x)) {
+        q->found = 0;
+        return;
+    }
+    switch (q->op) {
+    case WT_QUERY_ACCESS:
+        q->found = wt_access(tree, q->i, &value);
+        q->result = value;
+        break;
+    case WT_QUERY_RANK:
+        q->result = wt_rank(tree, q->x, q->i);
+        break;
+    case WT_QUERY_SELECT:
+        res = q->i ? wt_select(tree, q->x, q->i) : -1;
+        q->found = res >= 0 && (size_t)res < tree->len;
+        q->result = res;
+        break;
+    case WT_QUERY_QUANTILE:
+        q->found = wt_quantile(tree, q->i, q->j, q->x, &value);
+        q->result = value;
+        break;
+    case WT_QUERY_RANGE_FREQ:
+        // [x, y) is clamped to the 32-bit range, whose end isn't a 32-bit value
+        lo = q->x < INT32_MIN ? INT32_MIN : q->x;
+        hi = (int64_t)INT32_MAX + 1 < q->y ? (int64_t)INT32_MAX + 1 : q->y;
+        if (lo < hi)
+            q->result = _wt_batch_less(tree, q->i, q->j, hi) - _wt_batch_less(tree, q->i, q->j, lo);
+        break;
+    case WT_QUERY_RANGE_SUM:
+        q->found = (tree->flags & WT_FLAG_SUMS) != 0;
+        q->result = wt_range_sum(tree, q->i, q->j, q->x, q->y);
+        break;
+    default:
+        q->found = 0;
+    }
+}
+
+typedef struct wt_batch_shard {
+    const wt_tree *tree;
+    wt_query *queries;
+    size_t n;
+} wt_batch_shard;
+
+static void *_wt_query_shard(void *arg) {
+    wt_batch_shard *shard = arg;
+    size_t p;
+    for(p = 0; p < shard->n; ++p)
+        _wt_query(shard->tree, shard->queries + p);
+    return NULL;
+}
+
+void wt_query_batch(const wt_tree *tree, wt_query *queries, size_t n, int threads) {
+    pthread_t ids[WT_BATCH_MAX_THREADS];
+    wt_batch_shard shards[WT_BATCH_MAX_THREADS];
+    int k, m = threads, started[WT_BATCH_MAX_THREADS];
+    if (WT_BATCH_MAX_THREADS < m) m = WT_BATCH_MAX_THREADS;
+    if (n / WT_BATCH_MIN < (size_t)m) m = n / WT_BATCH_MIN;
+    if (m < 1) m = 1;
+
+    size_t size = (n + m - 1) / m, lo;
+    for(k = 0; k < m; ++k) {
+        lo = k * size < n ? k * size : n;
+        shards[k].tree = tree;
+        shards[k].queries = queries + lo;
+        shards[k].n = (lo + size < n ? lo + size : n) - lo;
+    }
+
+    // the calling thread takes the first shard, and any shard whose thread
+    // cannot be created
+    for(k = 1; k < m; ++k) {
+        started[k] = pthread_create(&ids[k], NULL, _wt_query_shard, shards + k) == 0;
+        if (!started[k]) _wt_query_shard(shards + k);
+    }
+    _wt_query_shard(shards);
+    for(k = 1; k < m; ++k)
+        if (started[k]) pthread_join(ids[k], NULL);
+}
@@ -0,0 +1,41 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include "common.h"
+#include "wavelet_tree.h"
+
+/*
+ * Batch queries
+ *
+ * Answers an array of independent queries over one tree, sharding it across
+ * threads. Each query calls the wt_* function it is named after. Ranges are
+ * half-open and counts 1-based, and x and y may lie outside the 32-bit range
+ * of the stored values.
+ */
+
+typedef enum wt_query_op {
+    WT_QUERY_ACCESS,        // value at i
+    WT_QUERY_RANK,          // occurrences of x in [0, i)
+    WT_QUERY_SELECT,        // position of the i-th occurrence of x
+    WT_QUERY_QUANTILE,      // x-th smallest value in [i, j)
+    WT_QUERY_RANGE_FREQ,    // elements of [i, j) within [x, y)
+    WT_QUERY_RANGE_SUM,     // sum of the elements of [i, j) within [x, y), needs WT_FLAG_SUMS
+} wt_query_op;
+
+typedef struct wt_query {
+    wt_query_op op;
+    size_t i, j;
+    int64_t x, y;
+    // Set by wt_query_batch. found is 0 when the query has no answer, e.g. an
+    // index out of range or a missing occurrence.
+    int found;
+    int64_t result;
+} wt_query;
+
+// Answers queries[0, n) on up to threads threads, each taking a contiguous
+// shard of at least WT_BATCH_MIN queries. The tree must not be modified
+// meanwhile.
+#define WT_BATCH_MIN 64
+void wt_query_batch(const wt_tree *tree, wt_query *queries, size_t n, int threads);
+
+#endif
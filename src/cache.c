@@ -0,0 +1,146 @@
+#include <string.h>
+
+#include "cache.h"
+
+#define WT_CACHE_MIN_BUCKETS 64
+
+static size_t _wt_cache_hash(const char *key, size_t klen) {
+    // FNV-1a
+    size_t i, h = 14695981039346656037ULL;
+    for(i = 0; i < klen; ++i) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static size_t _wt_cache_entry_size(const wt_cache_entry *entry) {
+    return sizeof(wt_cache_entry) + entry->klen + entry->vlen;
+}
+
+wt_cache *wt_cache_new(size_t capacity) {
+    wt_cache *cache = calloc(1, sizeof(wt_cache));
+    cache->capacity = capacity;
+    cache->nbuckets = WT_CACHE_MIN_BUCKETS;
+    cache->buckets = calloc(cache->nbuckets, sizeof(wt_cache_entry*));
+    return cache;
+}
+
+static void _wt_cache_lru_unlink(wt_cache *cache, wt_cache_entry *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else cache->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else cache->lru_tail = entry->lru_prev;
+}
+
+static void _wt_cache_lru_push(wt_cache *cache, wt_cache_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_prev = entry;
+    else cache->lru_tail = entry;
+    cache->lru_head = entry;
+}
+
+static void _wt_cache_remove(wt_cache *cache, wt_cache_entry *entry) {
+    wt_cache_entry **p = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+    while (*p != entry)
+        p = &(*p)->next;
+    *p = entry->next;
+    _wt_cache_lru_unlink(cache, entry);
+
+    cache->used -= _wt_cache_entry_size(entry);
+    --cache->len;
+    free(entry->key);
+    free(entry->value);
+    free(entry);
+}
+
+static void _wt_cache_evict(wt_cache *cache, size_t capacity) {
+    while (cache->lru_tail && capacity < cache->used) {
+        _wt_cache_remove(cache, cache->lru_tail);
+        ++cache->evictions;
+    }
+}
+
+static void _wt_cache_rehash(wt_cache *cache, size_t nbuckets) {
+    size_t b;
+    wt_cache_entry *entry, *next, **buckets = calloc(nbuckets, sizeof(wt_cache_entry*));
+    for(b = 0; b < cache->nbuckets; ++b) {
+        for(entry = cache->buckets[b]; entry; entry = next) {
+            next = entry->next;
+            entry->next = buckets[entry->hash & (nbuckets - 1)];
+            buckets[entry->hash & (nbuckets - 1)] = entry;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+}
+
+void wt_cache_clear(wt_cache *cache) {
+    while (cache->lru_head)
+        _wt_cache_remove(cache, cache->lru_head);
+    cache->hits = cache->misses = cache->evictions = 0;
+}
+
+void wt_cache_free(wt_cache *cache) {
+    wt_cache_clear(cache);
+    free(cache->buckets);
+    free(cache);
+}
+
+void wt_cache_resize(wt_cache *cache, size_t capacity) {
+    cache->capacity = capacity;
+    _wt_cache_evict(cache, capacity);
+}
+
+static wt_cache_entry *_wt_cache_find(wt_cache *cache, const char *key, size_t klen, size_t hash) {
+    wt_cache_entry *entry = cache->buckets[hash & (cache->nbuckets - 1)];
+    for(; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->klen == klen && memcmp(entry->key, key, klen) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+const void *wt_cache_get(wt_cache *cache, const char *key, size_t klen, size_t *vlen) {
+    wt_cache_entry *entry = _wt_cache_find(cache, key, klen, _wt_cache_hash(key, klen));
+    if (!entry) {
+        ++cache->misses;
+        return NULL;
+    }
+
+    ++cache->hits;
+    _wt_cache_lru_unlink(cache, entry);
+    _wt_cache_lru_push(cache, entry);
+    *vlen = entry->vlen;
+    return entry->value;
+}
+
+void wt_cache_put(wt_cache *cache, const char *key, size_t klen, const void *value, size_t vlen) {
+    size_t hash = _wt_cache_hash(key, klen);
+    wt_cache_entry *entry = _wt_cache_find(cache, key, klen, hash);
+    if (entry)
+        _wt_cache_remove(cache, entry);
+    if (cache->capacity < sizeof(wt_cache_entry) + klen + vlen)
+        return;
+
+    entry = malloc(sizeof(wt_cache_entry));
+    entry->hash = hash;
+    entry->klen = klen;
+    entry->vlen = vlen;
+    entry->key = malloc(klen + 1);
+    memcpy(entry->key, key, klen);
+    entry->value = malloc(vlen + 1);
+    memcpy(entry->value, value, vlen);
+
+    _wt_cache_evict(cache, cache->capacity - _wt_cache_entry_size(entry));
+    if (cache->nbuckets < cache->len + 1)
+        _wt_cache_rehash(cache, cache->nbuckets << 1);
+
+    entry->next = cache->buckets[hash & (cache->nbuckets - 1)];
+    cache->buckets[hash & (cache->nbuckets - 1)] = entry;
+    _wt_cache_lru_push(cache, entry);
+    cache->used += _wt_cache_entry_size(entry);
+    ++cache->len;
+}
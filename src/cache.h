@@ -0,0 +1,32 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "common.h"
+
+typedef struct wt_cache_entry {
+    struct wt_cache_entry *next;        // hash chain
+    struct wt_cache_entry *lru_prev, *lru_next;
+    size_t hash;
+    size_t klen, vlen;
+    char *key;
+    void *value;
+} wt_cache_entry;
+
+// LRU cache of opaque byte strings bounded by the bytes held by its entries
+typedef struct wt_cache {
+    size_t capacity, used;
+    size_t len, nbuckets;
+    wt_cache_entry **buckets;
+    // most recently used first
+    wt_cache_entry *lru_head, *lru_tail;
+    unsigned long long hits, misses, evictions;
+} wt_cache;
+
+wt_cache *wt_cache_new(size_t capacity);
+void wt_cache_free(wt_cache *cache);
+void wt_cache_clear(wt_cache *cache);
+void wt_cache_resize(wt_cache *cache, size_t capacity);
+const void *wt_cache_get(wt_cache *cache, const char *key, size_t klen, size_t *vlen);
+void wt_cache_put(wt_cache *cache, const char *key, size_t klen, const void *value, size_t vlen);
+
+#endif
@@ -1,8 +1,34 @@
 #ifndef __COMMON_H__
 #define __COMMON_H__
 
-#ifdef DEBUG
+#include <stdint.h>
+
+#if defined(DEBUG)
+#include <stdlib.h>
+#elif defined(WT_CORE)
+// The standalone core library (make core) allocates through the functions
+// set by wt_set_allocator, which default to those of the C library
 #include <stdlib.h>
+
+typedef struct wt_allocator {
+    void *(*malloc_fn)(size_t size);
+    void *(*calloc_fn)(size_t count, size_t size);
+    void *(*realloc_fn)(void *ptr, size_t size);
+    void (*free_fn)(void *ptr);
+} wt_allocator;
+
+// Must be called before any structure is built, since memory is released
+// with the allocator that is current at the time
+void wt_set_allocator(const wt_allocator *allocator);
+void *wt_mem_malloc(size_t size);
+void *wt_mem_calloc(size_t count, size_t size);
+void *wt_mem_realloc(void *ptr, size_t size);
+void wt_mem_free(void *ptr);
+
+#define malloc wt_mem_malloc
+#define calloc wt_mem_calloc
+#define realloc wt_mem_realloc
+#define free wt_mem_free
 #else
 #include "redismodule.h"
 #define malloc RedisModule_Alloc
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "fm_index.h"
+
+fm_index *fm_new(void) {
+    return calloc(1, sizeof(fm_index));
+}
+
+// Sorts the suffixes of text by prefix doubling with radix sort in
+// O(n log n), where a proper prefix sorts before the longer suffix.
+static void _fm_suffix_array(const unsigned char *text, int n, int *sa) {
+    int i, k, p, m = FM_ALPHABET;
+    int size = n < FM_ALPHABET ? FM_ALPHABET : n;
+    int *x = malloc(size * sizeof(int)), *y = malloc(size * sizeof(int)), *cnt = malloc(size * sizeof(int)), *t;
+
+    memset(cnt, 0, m * sizeof(int));
+    for(i = 0; i < n; ++i)
+        ++cnt[x[i] = text[i]];
+    for(i = 1; i < m; ++i)
+        cnt[i] += cnt[i-1];
+    for(i = n - 1; 0 <= i; --i)
+        sa[--cnt[x[i]]] = i;
+
+    for(k = 1; k < n; k <<= 1) {
+        // order by the second key: suffixes without it come first
+        p = 0;
+        for(i = n - k; i < n; ++i)
+            y[p++] = i;
+        for(i = 0; i < n; ++i)
+            if (k <= sa[i])
+                y[p++] = sa[i] - k;
+
+        // stable sort by the first key
+        memset(cnt, 0, m * sizeof(int));
+        for(i = 0; i < n; ++i)
+            ++cnt[x[y[i]]];
+        for(i = 1; i < m; ++i)
+            cnt[i] += cnt[i-1];
+        for(i = n - 1; 0 <= i; --i)
+            sa[--cnt[x[y[i]]]] = y[i];
+
+        t = x; x = y; y = t;
+        p = 1;
+        x[sa[0]] = 0;
+        for(i = 1; i < n; ++i) {
+            int a = sa[i-1], b = sa[i];
+            int ka = a + k < n ? y[a+k] : -1, kb = b + k < n ? y[b+k] : -1;
+            x[b] = (y[a] == y[b] && ka == kb) ? p - 1 : p++;
+        }
+        if (n <= p) break;
+        m = p;
+    }
+
+    free(x);
+    free(y);
+    free(cnt);
+}
+
+void fm_build(fm_index *fm, const unsigned char *text, size_t len) {
+    size_t i, r, n = len + 1;
+    int *sa = malloc(n * sizeof(int));
+
+    // Row 0 is the suffix consisting of the sentinel only
+    sa[0] = len;
+    _fm_suffix_array(text, len, sa + 1);
+
+    int32_t *bwt = malloc(n * sizeof(int32_t));
+    uint64_t *words = calloc(FID_NWORDS(fid, n), sizeof(uint64_t));
+    size_t nsamples = 0;
+    for(r = 0; r < n; ++r) {
+        if (sa[r]) {
+            bwt[r] = text[sa[r] - 1];
+        }
+        else {
+            bwt[r] = 0;
+            fm->primary = r;
+        }
+        if (sa[r] % FM_SAMPLE_RATE == 0) {
+            words[FID_I2WI(fid, r)] |= 1ULL << (r & FID_MASK_WI(fid));
+            ++nsamples;
+        }
+    }
+
+    fm->samples = malloc((nsamples + 1) * sizeof(uint32_t));
+    for(r = 0, nsamples = 0; r < n; ++r)
+        if (sa[r] % FM_SAMPLE_RATE == 0)
+            fm->samples[nsamples++] = sa[r];
+    fm->sampled = fid_new(words, n);
+    free(sa);
+
+    memset(fm->C, 0, sizeof(fm->C));
+    for(i = 0; i < len; ++i)
+        ++fm->C[text[i]];
+    size_t sum = 1, c;
+    for(i = 0; i < FM_ALPHABET; ++i) {
+        c = fm->C[i];
+        fm->C[i] = sum;
+        sum += c;
+    }
+
+    fm->len = len;
+    fm->bwt = wt_new_bounded(0, FM_ALPHABET - 1);
+    wt_build(fm->bwt, bwt, n);
+    free(bwt);
+}
+
+void fm_free(fm_index *fm) {
+    if (fm->bwt) wt_free(fm->bwt);
+    if (fm->sampled) fid_free(fm->sampled);
+    free(fm->samples);
+    free(fm);
+}
+
+// Number of occurrences of c in the BWT before row r, excluding the sentinel
+static inline size_t _fm_rank(const fm_index *fm, int c, size_t r) {
+    size_t res = wt_rank(fm->bwt, c, r);
+    if (c == 0 && fm->primary < r) --res;
+    return res;
+}
+
+static inline size_t _fm_lf(const fm_index *fm, int c, size_t r) {
+    return fm->C[c] + _fm_rank(fm, c, r);
+}
+
+size_t fm_extract(const fm_index *fm, unsigned char *out) {
+    size_t i, r = 0;
+    int32_t c;
+    for(i = fm->len; 0 < i; --i) {
+        wt_access(fm->bwt, r, &c);
+        out[i-1] = c;
+        r = _fm_lf(fm, c, r);
+    }
+    return fm->len;
+}
+
+// Narrows the rows [*sp, *ep) to the suffixes prefixed by pattern
+static void _fm_backward_search(const fm_index *fm, const unsigned char *pattern, size_t len, size_t *sp, size_t *ep) {
+    *sp = 0;
+    *ep = fm->len + 1;
+    while (len && *sp < *ep) {
+        int c = pattern[--len];
+        *sp = _fm_lf(fm, c, *sp);
+        *ep = _fm_lf(fm, c, *ep);
+    }
+}
+
+size_t fm_count(const fm_index *fm, const unsigned char *pattern, size_t len) {
+    if (!len) return 0;
+
+    size_t sp, ep;
+    _fm_backward_search(fm, pattern, len, &sp, &ep);
+    return sp < ep ? ep - sp : 0;
+}
+
+size_t fm_locate(const fm_index *fm, const unsigned char *pattern, size_t len, size_t limit, size_t *res) {
+    if (!len) return 0;
+
+    size_t sp, ep, r, cur, steps, n = 0;
+    int32_t c;
+    _fm_backward_search(fm, pattern, len, &sp, &ep);
+    for(r = sp; r < ep && n < limit; ++r) {
+        // The primary row is always sampled since its suffix starts at 0
+        for(cur = r, steps = 0; !fid_access(fm->sampled, cur); ++steps) {
+            wt_access(fm->bwt, cur, &c);
+            cur = _fm_lf(fm, c, cur);
+        }
+        res[n++] = fm->samples[fid_rank(fm->sampled, 1, cur)] + steps;
+    }
+    return n;
+}
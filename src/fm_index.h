@@ -0,0 +1,36 @@
+#ifndef __FM_INDEX_H__
+#define __FM_INDEX_H__
+
+#include "common.h"
+#include "wavelet_tree.h"
+
+#define FM_ALPHABET 256
+#define FM_SAMPLE_RATE 32
+
+/*
+ * FM-index
+ *
+ * The Burrows-Wheeler transform of a byte string is stored in a wavelet tree
+ * of height 8. The sentinel, which is smaller than any byte, is stored as 0
+ * in row `primary` and is excluded from ranks explicitly. Suffix array values
+ * of the text positions which are multiples of FM_SAMPLE_RATE are sampled for
+ * locating occurrences.
+ */
+
+typedef struct fm_index {
+    size_t len;
+    size_t primary;
+    size_t C[FM_ALPHABET];
+    wt_tree *bwt;
+    fid *sampled;
+    uint32_t *samples;
+} fm_index;
+
+fm_index *fm_new(void);
+void fm_build(fm_index *fm, const unsigned char *text, size_t len);
+void fm_free(fm_index *fm);
+size_t fm_extract(const fm_index *fm, unsigned char *out);
+size_t fm_count(const fm_index *fm, const unsigned char *pattern, size_t len);
+size_t fm_locate(const fm_index *fm, const unsigned char *pattern, size_t len, size_t limit, size_t *res);
+
+#endif
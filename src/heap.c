@@ -1,4 +1,5 @@
 #include "heap.h"
+#include "stats.h"
 
 heap *heap_new(void) {
     return calloc(1, sizeof(heap));
@@ -20,6 +21,7 @@ size_t heap_len(const heap *heap) {
 }
 
 void heap_push(heap *heap, int score, void *value) {
+    WT_STAT_INC(heap_pushes);
     if (heap->capacity < heap->len + 1) {
         heap->capacity += !heap->capacity;
         heap->capacity <<= 1;
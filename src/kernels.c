@@ -0,0 +1,193 @@
+#include <string.h>
+#include <strings.h>
+
+// immintrin.h pulls in stdlib.h, so it goes before common.h renames malloc
+#if defined(__x86_64__) || defined(__i386__)
+#define WT_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+#include "kernels.h"
+
+/*
+ * Portable bodies, inlined into each target below so that __builtin_popcountll
+ * becomes a popcnt instruction where the target has one
+ */
+
+#define WT_KERNEL_INLINE static inline __attribute__((always_inline))
+
+// Packs the values of a last partial word and returns how many are > mid
+WT_KERNEL_INLINE size_t _pack_tail(const int32_t *data, size_t p, size_t n, int32_t mid, uint64_t *words) {
+    uint64_t word = 0;
+    size_t q;
+    for(q = 0; p + q < n; ++q)
+        word |= (uint64_t)(data[p + q] > mid) << q;
+    words[FID_I2WI(fid, p)] = word;
+    return __builtin_popcountll(word);
+}
+
+WT_KERNEL_INLINE size_t _pack(const int32_t *data, size_t n, int32_t mid, uint64_t *words) {
+    size_t p, q, ones = 0;
+    uint64_t word;
+    for(p = 0; p + 64 <= n; p += 64) {
+        word = 0;
+        for(q = 0; q < 64; ++q)
+            word |= (uint64_t)(data[p + q] > mid) << q;
+        words[FID_I2WI(fid, p)] = word;
+        ones += __builtin_popcountll(word);
+    }
+    if (p < n)
+        ones += _pack_tail(data, p, n, mid, words);
+    return n - ones;
+}
+
+WT_KERNEL_INLINE size_t _popcount(const uint64_t *words, size_t n) {
+    size_t p, res = 0;
+    for(p = 0; p < n; ++p)
+        res += __builtin_popcountll(words[p]);
+    return res;
+}
+
+WT_KERNEL_INLINE void _rank_ranges(fid *fid, const wt_interval *ranges, size_t n, fid_ranks *out) {
+    size_t p;
+    for(p = 0; p < n; ++p)
+        out[p] = fid_rank_range(fid, ranges[p].i, ranges[p].j);
+}
+
+static size_t _pack_scalar(const int32_t *data, size_t n, int32_t mid, uint64_t *words) {
+    return _pack(data, n, mid, words);
+}
+
+static size_t _popcount_scalar(const uint64_t *words, size_t n) {
+    return _popcount(words, n);
+}
+
+static void _rank_ranges_scalar(fid *fid, const wt_interval *ranges, size_t n, fid_ranks *out) {
+    _rank_ranges(fid, ranges, n, out);
+}
+
+#ifdef WT_KERNELS_X86
+
+__attribute__((target("popcnt")))
+static size_t _pack_popcnt(const int32_t *data, size_t n, int32_t mid, uint64_t *words) {
+    return _pack(data, n, mid, words);
+}
+
+__attribute__((target("popcnt")))
+static size_t _popcount_popcnt(const uint64_t *words, size_t n) {
+    return _popcount(words, n);
+}
+
+__attribute__((target("popcnt")))
+static void _rank_ranges_popcnt(fid *fid, const wt_interval *ranges, size_t n, fid_ranks *out) {
+    _rank_ranges(fid, ranges, n, out);
+}
+
+// Compares 8 values at a time against mid and packs the signs with movemask
+__attribute__((target("avx2,popcnt")))
+static size_t _pack_avx2(const int32_t *data, size_t n, int32_t mid, uint64_t *words) {
+    __m256i m = _mm256_set1_epi32(mid), gt;
+    size_t p, q, ones = 0;
+    uint64_t word;
+    for(p = 0; p + 64 <= n; p += 64) {
+        word = 0;
+        for(q = 0; q < 64; q += 8) {
+            gt = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(data + p + q)), m);
+            word |= (uint64_t)(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(gt)) << q;
+        }
+        words[FID_I2WI(fid, p)] = word;
+        ones += __builtin_popcountll(word);
+    }
+    if (p < n)
+        ones += _pack_tail(data, p, n, mid, words);
+    return n - ones;
+}
+
+// Compares 16 values at a time straight into a mask register
+__attribute__((target("avx512f,popcnt")))
+static size_t _pack_avx512(const int32_t *data, size_t n, int32_t mid, uint64_t *words) {
+    __m512i m = _mm512_set1_epi32(mid);
+    size_t p, q, ones = 0;
+    uint64_t word;
+    for(p = 0; p + 64 <= n; p += 64) {
+        word = 0;
+        for(q = 0; q < 64; q += 16)
+            word |= (uint64_t)_mm512_cmpgt_epi32_mask(_mm512_loadu_si512(data + p + q), m) << q;
+        words[FID_I2WI(fid, p)] = word;
+        ones += __builtin_popcountll(word);
+    }
+    if (p < n)
+        ones += _pack_tail(data, p, n, mid, words);
+    return n - ones;
+}
+
+// Counts 8 words per instruction, loading a partial last vector under a mask
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static size_t _popcount_avx512(const uint64_t *words, size_t n) {
+    __m512i acc = _mm512_setzero_si512();
+    size_t p;
+    for(p = 0; p + 8 <= n; p += 8)
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_loadu_si512(words + p)));
+    if (p < n)
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_maskz_loadu_epi64((__mmask8)((1U << (n - p)) - 1), words + p)));
+    return _mm512_reduce_add_epi64(acc);
+}
+
+#endif
+
+/*
+ * Selection
+ */
+
+static const wt_kernels Kernels[] = {
+    {"scalar", _pack_scalar, _popcount_scalar, _rank_ranges_scalar},
+#ifdef WT_KERNELS_X86
+    {"popcnt", _pack_popcnt, _popcount_popcnt, _rank_ranges_popcnt},
+    {"avx2", _pack_avx2, _popcount_popcnt, _rank_ranges_popcnt},
+    {"avx512", _pack_avx512, _popcount_avx512, _rank_ranges_popcnt},
+#endif
+};
+
+#define WT_KERNELS_LEN (sizeof(Kernels) / sizeof(Kernels[0]))
+
+const wt_kernels *wt_kernels_active = Kernels;
+
+// Kernels are listed from the most portable up, each needing the instructions
+// of the ones before it
+static int _wt_kernels_supported(size_t k) {
+#ifdef WT_KERNELS_X86
+    __builtin_cpu_init();
+    switch (k) {
+    case 3:
+        if (!__builtin_cpu_supports("avx512f") || !__builtin_cpu_supports("avx512vpopcntdq"))
+            return 0;
+        /* fall through */
+    case 2:
+        if (!__builtin_cpu_supports("avx2"))
+            return 0;
+        /* fall through */
+    case 1:
+        return __builtin_cpu_supports("popcnt");
+    }
+#endif
+    return k == 0;
+}
+
+int wt_kernels_init(const char *name) {
+    size_t k;
+    if (!name || !strcasecmp(name, "auto")) {
+        for(k = WT_KERNELS_LEN - 1; k > 0 && !_wt_kernels_supported(k); --k);
+        wt_kernels_active = Kernels + k;
+        return 1;
+    }
+
+    for(k = 0; k < WT_KERNELS_LEN; ++k) {
+        if (!strcasecmp(name, Kernels[k].name)) {
+            if (!_wt_kernels_supported(k))
+                return 0;
+            wt_kernels_active = Kernels + k;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __KERNELS_H__
+#define __KERNELS_H__
+
+#include "wavelet_tree.h"
+
+// Bulk kernels of construction and batched queries. The module is built for
+// the baseline x86-64 instruction set, so each kernel is compiled once per
+// instruction set with target attributes and the best one the CPU supports is
+// picked at load time. Every variant returns the same results.
+typedef struct wt_kernels {
+    const char *name;
+    // Sets bit p of words (zeroed by the caller) for each data[p] > mid and
+    // returns how many of the n values are <= mid
+    size_t (*pack)(const int32_t *data, size_t n, int32_t mid, uint64_t *words);
+    // Number of set bits in words[0, n)
+    size_t (*popcount)(const uint64_t *words, size_t n);
+    // fid_rank_range of each of the n intervals
+    void (*rank_ranges)(fid *fid, const wt_interval *ranges, size_t n, fid_ranks *out);
+} wt_kernels;
+
+extern const wt_kernels *wt_kernels_active;
+
+// Selects the kernels by name: scalar, popcnt, avx2 or avx512, or the best
+// supported ones for NULL or auto. Returns 0 if the name is unknown or the CPU
+// lacks the instructions, leaving the selection unchanged.
+int wt_kernels_init(const char *name);
+
+#endif
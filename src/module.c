@@ -1,7 +1,17 @@
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
 #include "redismodule.h"
 #include "wavelet_tree.h"
+#include "point_grid.h"
+#include "fm_index.h"
+#include "cache.h"
+#include "kernels.h"
+#include "batch.h"
 
 /*
  * Utilities
@@ -12,16 +22,282 @@ extern int string2ll(const char *s, size_t slen, long long *value);
 // This function is replaced by Redis.
 int string2ll(const char *s, size_t slen, long long *value){ return 0; }
 
+/*
+ * Result cache
+ */
+
+// Disabled until given a capacity with the CACHE module argument or wvltr.cache SIZE
+static wt_cache *ResultCache;
+
+// Replies of cacheable commands are recorded as (type, value) token pairs
+#define REPLY_TOKEN_ARRAY 0
+#define REPLY_TOKEN_INTEGER 1
+#define REPLY_TOKEN_NULL 2
+
+typedef struct reply_sink {
+    RedisModuleCtx *ctx;
+    // cache key and recorded tokens, NULL when the reply is not cached
+    char *key;
+    size_t klen;
+    long long *tokens;
+    size_t len, capacity;
+    // token index of the array whose length is postponed
+    size_t postponed;
+} reply_sink;
+
+static void _sink_record(reply_sink *sink, long long type, long long value) {
+    if (!sink->key) return;
+    if (sink->capacity < sink->len + 2) {
+        sink->capacity = sink->capacity ? sink->capacity << 1 : 16;
+        sink->tokens = RedisModule_Realloc(sink->tokens, sink->capacity * sizeof(long long));
+    }
+    sink->tokens[sink->len++] = type;
+    sink->tokens[sink->len++] = value;
+}
+
+static void _sink_array(reply_sink *sink, long len) {
+    if (len == REDISMODULE_POSTPONED_ARRAY_LEN)
+        sink->postponed = sink->len;
+    RedisModule_ReplyWithArray(sink->ctx, len);
+    _sink_record(sink, REPLY_TOKEN_ARRAY, len);
+}
+
+static void _sink_set_array_length(reply_sink *sink, long len) {
+    RedisModule_ReplySetArrayLength(sink->ctx, len);
+    if (sink->key)
+        sink->tokens[sink->postponed + 1] = len;
+}
+
+static void _sink_integer(reply_sink *sink, long long value) {
+    RedisModule_ReplyWithLongLong(sink->ctx, value);
+    _sink_record(sink, REPLY_TOKEN_INTEGER, value);
+}
+
+static void _sink_null(reply_sink *sink) {
+    RedisModule_ReplyWithNull(sink->ctx);
+    _sink_record(sink, REPLY_TOKEN_NULL, 0);
+}
+
+static void _sink_value_count_callback(void *user_data, int32_t value, int count) {
+    reply_sink *sink = user_data;
+
+    _sink_array(sink, 2);
+    _sink_integer(sink, value);
+    _sink_integer(sink, count);
+}
+
+static void _sink_init(reply_sink *sink, RedisModuleCtx *ctx) {
+    memset(sink, 0, sizeof(*sink));
+    sink->ctx = ctx;
+}
+
+// Starts a reply for a read-only query on tree, serving it from the cache when possible.
+// Returns 1 if the reply has already been sent.
+static int _cache_begin(reply_sink *sink, RedisModuleCtx *ctx, RedisModuleString **argv, int argc, const wt_tree *tree) {
+    _sink_init(sink, ctx);
+    if (!ResultCache || !ResultCache->capacity)
+        return 0;
+
+    // generation, then each argument prefixed by its length with the command name lowercased
+    int a;
+    size_t p, len, klen = sizeof(tree->generation);
+    for(a = 0; a < argc; ++a) {
+        RedisModule_StringPtrLen(argv[a], &len);
+        klen += sizeof(len) + len;
+    }
+    char *key = RedisModule_Alloc(klen);
+    memcpy(key, &tree->generation, sizeof(tree->generation));
+    for(a = 0, klen = sizeof(tree->generation); a < argc; ++a) {
+        const char *str = RedisModule_StringPtrLen(argv[a], &len);
+        memcpy(key + klen, &len, sizeof(len));
+        klen += sizeof(len);
+        for(p = 0; p < len; ++p)
+            key[klen + p] = a ? str[p] : tolower((unsigned char)str[p]);
+        klen += len;
+    }
+
+    const long long *tokens = wt_cache_get(ResultCache, key, klen, &len);
+    if (!tokens) {
+        sink->key = key;
+        sink->klen = klen;
+        return 0;
+    }
+
+    RedisModule_Free(key);
+    for(p = 0; p < len / sizeof(long long); p += 2) {
+        if (tokens[p] == REPLY_TOKEN_ARRAY)
+            RedisModule_ReplyWithArray(ctx, tokens[p+1]);
+        else if (tokens[p] == REPLY_TOKEN_INTEGER)
+            RedisModule_ReplyWithLongLong(ctx, tokens[p+1]);
+        else
+            RedisModule_ReplyWithNull(ctx);
+    }
+    return 1;
+}
+
+// Stores the recorded reply, if any.
+static void _cache_end(reply_sink *sink) {
+    if (!sink->key) return;
+    wt_cache_put(ResultCache, sink->key, sink->klen, sink->tokens, sink->len * sizeof(long long));
+    RedisModule_Free(sink->key);
+    if (sink->tokens)
+        RedisModule_Free(sink->tokens);
+}
+
+/*
+ * Statistics
+ */
+
+#ifdef WT_STATS
+
+#define STATS_MAX_COMMANDS 64
+
+// Latency of each command, timed around its handler
+typedef struct command_stats {
+    const char *name;
+    RedisModuleCmdFunc func;
+    wt_histogram latency;
+} command_stats;
+
+static command_stats CommandStats[STATS_MAX_COMMANDS];
+static int CommandStatsLen;
+
+static int _stats_dispatch(int c, RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    uint64_t start = wt_clock_ns();
+    int ret = CommandStats[c].func(ctx, argv, argc);
+    wt_histogram_add(&CommandStats[c].latency, wt_clock_ns() - start);
+    return ret;
+}
+
+// Command handlers get no user data, so each slot has its own trampoline
+// that knows its index instead of looking the command name up per call.
+#define STATS_DISPATCH(a, b) \
+    static int _stats_dispatch_##a##b(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) { \
+        return _stats_dispatch((a) * 8 + (b), ctx, argv, argc); \
+    }
+#define STATS_DISPATCH8(a) \
+    STATS_DISPATCH(a, 0) STATS_DISPATCH(a, 1) STATS_DISPATCH(a, 2) STATS_DISPATCH(a, 3) \
+    STATS_DISPATCH(a, 4) STATS_DISPATCH(a, 5) STATS_DISPATCH(a, 6) STATS_DISPATCH(a, 7)
+#define STATS_SLOT8(a) \
+    _stats_dispatch_##a##0, _stats_dispatch_##a##1, _stats_dispatch_##a##2, _stats_dispatch_##a##3, \
+    _stats_dispatch_##a##4, _stats_dispatch_##a##5, _stats_dispatch_##a##6, _stats_dispatch_##a##7
+
+STATS_DISPATCH8(0) STATS_DISPATCH8(1) STATS_DISPATCH8(2) STATS_DISPATCH8(3)
+STATS_DISPATCH8(4) STATS_DISPATCH8(5) STATS_DISPATCH8(6) STATS_DISPATCH8(7)
+
+static const RedisModuleCmdFunc StatsDispatch[STATS_MAX_COMMANDS] = {
+    STATS_SLOT8(0), STATS_SLOT8(1), STATS_SLOT8(2), STATS_SLOT8(3),
+    STATS_SLOT8(4), STATS_SLOT8(5), STATS_SLOT8(6), STATS_SLOT8(7),
+};
+
+// The API table is resolved by RedisModule_Init, so commands and replies are
+// instrumented by swapping in wrappers rather than touching every call site.
+static int (*_stats_create_command)(RedisModuleCtx*, const char*, RedisModuleCmdFunc, const char*, int, int, int);
+static int (*_stats_reply_with_long_long)(RedisModuleCtx*, long long);
+static int (*_stats_reply_with_null)(RedisModuleCtx*);
+static int (*_stats_reply_with_simple_string)(RedisModuleCtx*, const char*);
+static int (*_stats_reply_with_array)(RedisModuleCtx*, long);
+static int (*_stats_reply_with_double)(RedisModuleCtx*, double);
+static int (*_stats_reply_with_error)(RedisModuleCtx*, const char*);
+static int (*_stats_reply_with_string_buffer)(RedisModuleCtx*, const char*, size_t);
+static int (*_stats_reply_with_string)(RedisModuleCtx*, RedisModuleString*);
+static int (*_stats_wrong_arity)(RedisModuleCtx*);
+
+static int _stats_CreateCommand(RedisModuleCtx *ctx, const char *name, RedisModuleCmdFunc func,
+        const char *flags, int firstkey, int lastkey, int keystep) {
+    if (CommandStatsLen == STATS_MAX_COMMANDS)
+        return REDISMODULE_ERR;
+    CommandStats[CommandStatsLen].name = name;
+    CommandStats[CommandStatsLen].func = func;
+    return _stats_create_command(ctx, name, StatsDispatch[CommandStatsLen++], flags, firstkey, lastkey, keystep);
+}
+
+static int _stats_ReplyWithLongLong(RedisModuleCtx *ctx, long long ll) {
+    WT_STAT_INC(reply_elements);
+    return _stats_reply_with_long_long(ctx, ll);
+}
+
+static int _stats_ReplyWithNull(RedisModuleCtx *ctx) {
+    WT_STAT_INC(reply_elements);
+    return _stats_reply_with_null(ctx);
+}
+
+static int _stats_ReplyWithSimpleString(RedisModuleCtx *ctx, const char *msg) {
+    WT_STAT_INC(reply_elements);
+    return _stats_reply_with_simple_string(ctx, msg);
+}
+
+static int _stats_ReplyWithArray(RedisModuleCtx *ctx, long len) {
+    WT_STAT_INC(reply_elements);
+    return _stats_reply_with_array(ctx, len);
+}
+
+static int _stats_ReplyWithDouble(RedisModuleCtx *ctx, double d) {
+    WT_STAT_INC(reply_elements);
+    return _stats_reply_with_double(ctx, d);
+}
+
+static int _stats_ReplyWithError(RedisModuleCtx *ctx, const char *err) {
+    WT_STAT_INC(reply_elements);
+    return _stats_reply_with_error(ctx, err);
+}
+
+static int _stats_ReplyWithStringBuffer(RedisModuleCtx *ctx, const char *buf, size_t len) {
+    WT_STAT_INC(reply_elements);
+    return _stats_reply_with_string_buffer(ctx, buf, len);
+}
+
+static int _stats_ReplyWithString(RedisModuleCtx *ctx, RedisModuleString *str) {
+    WT_STAT_INC(reply_elements);
+    return _stats_reply_with_string(ctx, str);
+}
+
+static int _stats_WrongArity(RedisModuleCtx *ctx) {
+    WT_STAT_INC(reply_elements);
+    return _stats_wrong_arity(ctx);
+}
+
+static void _stats_install(void) {
+    _stats_create_command = RedisModule_CreateCommand;
+    RedisModule_CreateCommand = _stats_CreateCommand;
+    _stats_reply_with_long_long = RedisModule_ReplyWithLongLong;
+    RedisModule_ReplyWithLongLong = _stats_ReplyWithLongLong;
+    _stats_reply_with_null = RedisModule_ReplyWithNull;
+    RedisModule_ReplyWithNull = _stats_ReplyWithNull;
+    _stats_reply_with_simple_string = RedisModule_ReplyWithSimpleString;
+    RedisModule_ReplyWithSimpleString = _stats_ReplyWithSimpleString;
+    _stats_reply_with_array = RedisModule_ReplyWithArray;
+    RedisModule_ReplyWithArray = _stats_ReplyWithArray;
+    _stats_reply_with_double = RedisModule_ReplyWithDouble;
+    RedisModule_ReplyWithDouble = _stats_ReplyWithDouble;
+    _stats_reply_with_error = RedisModule_ReplyWithError;
+    RedisModule_ReplyWithError = _stats_ReplyWithError;
+    _stats_reply_with_string_buffer = RedisModule_ReplyWithStringBuffer;
+    RedisModule_ReplyWithStringBuffer = _stats_ReplyWithStringBuffer;
+    _stats_reply_with_string = RedisModule_ReplyWithString;
+    RedisModule_ReplyWithString = _stats_ReplyWithString;
+    _stats_wrong_arity = RedisModule_WrongArity;
+    RedisModule_WrongArity = _stats_WrongArity;
+}
+
+#endif
+
 /*
  * Wavelet Tree type
  */
 
 static RedisModuleType *WaveletTreeType;
 
+// Source of wt_tree generations, incremented whenever a tree is (re)built
+static unsigned long long NextGeneration = 1;
+
+#define WAVELET_TREE_ENCVER 1
+
 void *WaveletTreeType_Load(RedisModuleIO *rdb, int encver) {
-    if (encver != 0) return NULL;
+    if (encver > WAVELET_TREE_ENCVER) return NULL;
 
     uint32_t i;
+    int flags = encver >= 1 ? RedisModule_LoadUnsigned(rdb) : 0;
     uint32_t len = RedisModule_LoadUnsigned(rdb);
     int32_t *buffer = RedisModule_Calloc(len, sizeof(uint32_t));
 
@@ -29,38 +305,58 @@ void *WaveletTreeType_Load(RedisModuleIO *rdb, int encver) {
         buffer[i] = RedisModule_LoadSigned(rdb);
 
     wt_tree *tree = wt_new();
+    tree->flags = flags;
+    tree->generation = NextGeneration++;
     wt_build(tree, buffer, len);
+    RedisModule_Free(buffer);
     return tree;
 }
 
 void WaveletTreeType_Save(RedisModuleIO *rdb, void *value) {
     wt_tree *tree = value;
     uint32_t i;
-    int32_t res;
+    int32_t *buffer = RedisModule_Calloc(tree->len + 1, sizeof(int32_t));
 
+    wt_get_range(tree, 0, tree->len, buffer);
+
+    RedisModule_SaveUnsigned(rdb, tree->flags);
     RedisModule_SaveUnsigned(rdb, tree->len);
-    for(i = 0; i < tree->len; ++i) {
-        assert(wt_access(tree, i, &res));
-        RedisModule_SaveSigned(rdb, res);
-    }
+    for(i = 0; i < tree->len; ++i)
+        RedisModule_SaveSigned(rdb, buffer[i]);
+
+    RedisModule_Free(buffer);
 }
 
 void WaveletTreeType_Rewrite(RedisModuleIO *aof, RedisModuleString *key, void *value) {
     wt_tree *tree = value;
     uint32_t i;
-    int32_t v;
+    int32_t v, *values;
     char *buffer, *bhead;
 
+    values = RedisModule_Calloc(tree->len + 1, sizeof(int32_t));
+    wt_get_range(tree, 0, tree->len, values);
+
     bhead = buffer = RedisModule_Calloc((tree->len << 2) + 1, sizeof(char));
     for(i = 0; i < tree->len; ++i) {
-        assert(wt_access(tree, i, &v));
+        v = values[i];
         *(bhead++) = (v >> 24) & 0xFF;
         *(bhead++) = (v >> 16) & 0xFF;
         *(bhead++) = (v >> 8) & 0xFF;
         *(bhead++) = v & 0xFF;
     }
-    RedisModule_EmitAOF(aof, "wvltr.set", "sb", key, buffer, tree->len<<2);
+    const char *opts[2];
+    int nopts = 0;
+    if (tree->flags & WT_FLAG_DISTINCT) opts[nopts++] = "DISTINCT";
+    if (tree->flags & WT_FLAG_SUMS) opts[nopts++] = "SUMS";
+
+    if (nopts == 2)
+        RedisModule_EmitAOF(aof, "wvltr.set", "sbcc", key, buffer, tree->len<<2, opts[0], opts[1]);
+    else if (nopts == 1)
+        RedisModule_EmitAOF(aof, "wvltr.set", "sbc", key, buffer, tree->len<<2, opts[0]);
+    else
+        RedisModule_EmitAOF(aof, "wvltr.set", "sb", key, buffer, tree->len<<2);
     RedisModule_Free(buffer);
+    RedisModule_Free(values);
 }
 
 void WaveletTreeType_Digest(RedisModuleDigest *digest, void *value) {
@@ -70,15 +366,152 @@ void WaveletTreeType_Free(void *value) {
     wt_free(value);
 }
 
+/*
+ * Point Grid type
+ */
+
+static RedisModuleType *PointGridType;
+
+void *PointGridType_Load(RedisModuleIO *rdb, int encver) {
+    if (encver != 0) return NULL;
+
+    uint32_t i;
+    uint32_t len = RedisModule_LoadUnsigned(rdb);
+    int32_t *xs = RedisModule_Calloc(len + 1, sizeof(int32_t));
+    int32_t *ys = RedisModule_Calloc(len + 1, sizeof(int32_t));
+
+    for(i = 0; i < len; ++i) {
+        xs[i] = RedisModule_LoadSigned(rdb);
+        ys[i] = RedisModule_LoadSigned(rdb);
+    }
+
+    wt_grid *grid = wt_grid_new();
+    wt_grid_build(grid, xs, ys, len);
+    RedisModule_Free(xs);
+    RedisModule_Free(ys);
+    return grid;
+}
+
+void PointGridType_Save(RedisModuleIO *rdb, void *value) {
+    wt_grid *grid = value;
+    uint32_t i;
+    int32_t *ys = RedisModule_Calloc(grid->len + 1, sizeof(int32_t));
+
+    wt_grid_get_ys(grid, ys);
+
+    RedisModule_SaveUnsigned(rdb, grid->len);
+    for(i = 0; i < grid->len; ++i) {
+        RedisModule_SaveSigned(rdb, grid->xs[i]);
+        RedisModule_SaveSigned(rdb, ys[i]);
+    }
+
+    RedisModule_Free(ys);
+}
+
+void PointGridType_Rewrite(RedisModuleIO *aof, RedisModuleString *key, void *value) {
+    wt_grid *grid = value;
+    uint32_t i, j;
+    int32_t *ys;
+    char *buffer, *bhead;
+
+    ys = RedisModule_Calloc(grid->len + 1, sizeof(int32_t));
+    wt_grid_get_ys(grid, ys);
+
+    bhead = buffer = RedisModule_Calloc((grid->len << 3) + 1, sizeof(char));
+    for(i = 0; i < grid->len; ++i) {
+        for(j = 0; j < 4; ++j)
+            *(bhead++) = (grid->xs[i] >> (24 - (j << 3))) & 0xFF;
+        for(j = 0; j < 4; ++j)
+            *(bhead++) = (ys[i] >> (24 - (j << 3))) & 0xFF;
+    }
+    RedisModule_EmitAOF(aof, "wvltr.pointset", "sb", key, buffer, grid->len<<3);
+    RedisModule_Free(buffer);
+    RedisModule_Free(ys);
+}
+
+void PointGridType_Digest(RedisModuleDigest *digest, void *value) {
+}
+
+void PointGridType_Free(void *value) {
+    wt_grid_free(value);
+}
+
+/*
+ * FM-index type
+ */
+
+static RedisModuleType *FMIndexType;
+
+void *FMIndexType_Load(RedisModuleIO *rdb, int encver) {
+    if (encver != 0) return NULL;
+
+    size_t len;
+    char *text = RedisModule_LoadStringBuffer(rdb, &len);
+
+    fm_index *fm = fm_new();
+    fm_build(fm, (unsigned char *)text, len);
+    RedisModule_Free(text);
+    return fm;
+}
+
+void FMIndexType_Save(RedisModuleIO *rdb, void *value) {
+    fm_index *fm = value;
+    unsigned char *text = RedisModule_Calloc(fm->len + 1, sizeof(char));
+
+    fm_extract(fm, text);
+    RedisModule_SaveStringBuffer(rdb, (char *)text, fm->len);
+
+    RedisModule_Free(text);
+}
+
+void FMIndexType_Rewrite(RedisModuleIO *aof, RedisModuleString *key, void *value) {
+    fm_index *fm = value;
+    unsigned char *text = RedisModule_Calloc(fm->len + 1, sizeof(char));
+
+    fm_extract(fm, text);
+    RedisModule_EmitAOF(aof, "wvltr.fmbuild", "sb", key, (char *)text, fm->len);
+
+    RedisModule_Free(text);
+}
+
+void FMIndexType_Digest(RedisModuleDigest *digest, void *value) {
+}
+
+void FMIndexType_Free(void *value) {
+    fm_free(value);
+}
+
 /*
  * Commands
  */
 
-// wvltr.buildl DESTINATION KEY
+// Parses the optional index flags given after the mandatory arguments of a
+// build command.
+int _parse_build_flags(RedisModuleString **argv, int argc, int *flags) {
+    int i;
+    const char *opt;
+    *flags = 0;
+    for(i = 0; i < argc; ++i) {
+        opt = RedisModule_StringPtrLen(argv[i], NULL);
+        if (!strcasecmp(opt, "distinct"))
+            *flags |= WT_FLAG_DISTINCT;
+        else if (!strcasecmp(opt, "sums"))
+            *flags |= WT_FLAG_SUMS;
+        else
+            return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+// wvltr.buildl DESTINATION KEY [DISTINCT] [SUMS]
 int WaveletTreeBuildFromList_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 3)
+    if (argc < 3)
         return RedisModule_WrongArity(ctx);
 
+    int flags;
+    if (_parse_build_flags(argv + 3, argc - 3, &flags) != REDISMODULE_OK)
+        return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
 
     int type = RedisModule_KeyType(key);
@@ -88,6 +521,8 @@ int WaveletTreeBuildFromList_RedisCommand(RedisModuleCtx *ctx, RedisModuleString
     }
 
     wt_tree *tree = wt_new();
+    tree->flags = flags;
+    tree->generation = NextGeneration++;
     RedisModule_ModuleTypeSetValue(key, WaveletTreeType, tree);
 
     RedisModuleCallReply *reply = RedisModule_Call(ctx, "LRANGE", "scc", argv[2], "0", "-1"), *subreply;
@@ -134,11 +569,15 @@ int WaveletTreeBuildFromList_RedisCommand(RedisModuleCtx *ctx, RedisModuleString
     return REDISMODULE_OK;
 }
 
-// wvltr.set KEY BYTES
+// wvltr.set KEY BYTES [DISTINCT] [SUMS]
 int WaveletTreeSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 3)
+    if (argc < 3)
         return RedisModule_WrongArity(ctx);
 
+    int flags;
+    if (_parse_build_flags(argv + 3, argc - 3, &flags) != REDISMODULE_OK)
+        return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
 
     int type = RedisModule_KeyType(key);
@@ -160,6 +599,8 @@ int WaveletTreeSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, i
     }
 
     wt_tree *tree = wt_new();
+    tree->flags = flags;
+    tree->generation = NextGeneration++;
     wt_build(tree, data, len>>2);
 
     RedisModule_ModuleTypeSetValue(key, WaveletTreeType, tree);
@@ -210,6 +651,53 @@ int WaveletTreeAccess_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv
     return REDISMODULE_OK;
 }
 
+// wvltr.getrange KEY FROM TO
+int WaveletTreeGetRange_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 4)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY || from < 0 || to <= from) {
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithArray(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    if (tree->len < to) to = tree->len;
+    if (to <= from) {
+        RedisModule_ReplyWithArray(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    int32_t *values = RedisModule_Calloc(to - from, sizeof(int32_t));
+    size_t i, len = wt_get_range(tree, from, to, values);
+
+    RedisModule_ReplyWithArray(ctx, len);
+    for(i = 0; i < len; ++i)
+        RedisModule_ReplyWithLongLong(ctx, values[i]);
+
+    RedisModule_Free(values);
+    return REDISMODULE_OK;
+}
+
 // wvltr.rank KEY VALUE INDEX
 int WaveletTreeRank_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     if (argc != 4)
@@ -283,21 +771,19 @@ int WaveletTreeSelect_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv
     return REDISMODULE_OK;
 }
 
-// wvltr.quantile KEY FROM TO COUNT
-int WaveletTreeQuantile_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 5)
+// wvltr.nextpos KEY VALUE FROM
+int WaveletTreeNextPos_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 4)
         return RedisModule_WrongArity(ctx);
 
-    long long from, to, count;
-    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
-        return REDISMODULE_ERR;
-    }
-    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+    long long value, from;
+    if (RedisModule_StringToLongLong(argv[2], &value) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-    if (RedisModule_StringToLongLong(argv[4], &count) != REDISMODULE_OK) {
+    if (RedisModule_StringToLongLong(argv[3], &from) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
+    if (from < 0) from = 0;
 
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
 
@@ -314,35 +800,29 @@ int WaveletTreeQuantile_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **ar
     }
 
     wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
-        RedisModule_CloseKey(key);
+    RedisModule_CloseKey(key);
 
-    int32_t res;
-    if (wt_quantile(tree, from, to, count, &res))
-        RedisModule_ReplyWithLongLong(ctx, res);
-    else
+    int res = wt_next_pos(tree, value, from);
+    if (res == -1)
         RedisModule_ReplyWithNull(ctx);
-
+    else
+        RedisModule_ReplyWithLongLong(ctx, res);
     return REDISMODULE_OK;
 }
 
-// wvltr.rangefreq KEY FROM TO MIN MAX
-int WaveletTreeRangeFreq_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 6)
+// wvltr.prevpos KEY VALUE TO
+int WaveletTreePrevPos_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 4)
         return RedisModule_WrongArity(ctx);
 
-    long long from, to, min, max;
-    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+    long long value, to;
+    if (RedisModule_StringToLongLong(argv[2], &value) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
     if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-    if (RedisModule_StringToLongLong(argv[4], &min) != REDISMODULE_OK) {
-        return REDISMODULE_ERR;
-    }
-    if (RedisModule_StringToLongLong(argv[5], &max) != REDISMODULE_OK) {
-        return REDISMODULE_ERR;
-    }
+    if (to < 0) to = 0;
 
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
 
@@ -354,44 +834,45 @@ int WaveletTreeRangeFreq_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **a
 
     if (type == REDISMODULE_KEYTYPE_EMPTY) {
         RedisModule_CloseKey(key);
-        RedisModule_ReplyWithLongLong(ctx, 0);
+        RedisModule_ReplyWithNull(ctx);
         return REDISMODULE_OK;
     }
 
     wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
-    int res = wt_range_freq(tree, from, to, min, max);
-
     RedisModule_CloseKey(key);
-    RedisModule_ReplyWithLongLong(ctx, res);
-    return REDISMODULE_OK;
-}
-
-void _value_count_callback(void *user_data, int32_t value, int count) {
-    RedisModuleCtx *ctx = user_data;
 
-    RedisModule_ReplyWithArray(ctx, 2);
-    RedisModule_ReplyWithLongLong(ctx, value);
-    RedisModule_ReplyWithLongLong(ctx, count);
+    int res = wt_prev_pos(tree, value, to);
+    if (res == -1)
+        RedisModule_ReplyWithNull(ctx);
+    else
+        RedisModule_ReplyWithLongLong(ctx, res);
+    return REDISMODULE_OK;
 }
 
-// wvltr.rangelist KEY FROM TO MIN MAX
-int WaveletTreeRangeList_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 6)
+// wvltr.positions KEY VALUE FROM TO CURSOR COUNT
+int WaveletTreePositions_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 7)
         return RedisModule_WrongArity(ctx);
 
-    long long from, to, min, max;
-    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+    long long value, from, to, cursor, count;
+    if (RedisModule_StringToLongLong(argv[2], &value) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+    if (RedisModule_StringToLongLong(argv[3], &from) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-    if (RedisModule_StringToLongLong(argv[4], &min) != REDISMODULE_OK) {
+    if (RedisModule_StringToLongLong(argv[4], &to) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-    if (RedisModule_StringToLongLong(argv[5], &max) != REDISMODULE_OK) {
+    if (RedisModule_StringToLongLong(argv[5], &cursor) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[6], &count) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
+    if (from < 0) from = 0;
+    if (cursor < 0) cursor = 0;
+    if (count < 0) count = 0;
 
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
 
@@ -401,8 +882,10 @@ int WaveletTreeRangeList_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **a
         return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
+    RedisModule_ReplyWithArray(ctx, 2);
     if (type == REDISMODULE_KEYTYPE_EMPTY) {
         RedisModule_CloseKey(key);
+        RedisModule_ReplyWithLongLong(ctx, 0);
         RedisModule_ReplyWithArray(ctx, 0);
         return REDISMODULE_OK;
     }
@@ -410,31 +893,57 @@ int WaveletTreeRangeList_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **a
     wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
     RedisModule_CloseKey(key);
 
-    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
-    int len = wt_range_list(tree, from, to, min, max, _value_count_callback, ctx);
-    RedisModule_ReplySetArrayLength(ctx, len);
+    // The reply buffer is sized by count, so it must not exceed the range
+    if (tree->len < to) to = tree->len;
+    if (to < from) to = from;
+    if (to - from < count) count = to - from;
+    size_t p, total, *res = RedisModule_Calloc(count + 1, sizeof(size_t));
+    size_t len = wt_positions(tree, value, from, to, cursor, count, res, &total);
+
+    // The next cursor is the offset of the first occurrence not yet returned,
+    // or 0 once the range has been exhausted.
+    RedisModule_ReplyWithLongLong(ctx, cursor + len < total ? cursor + len : 0);
+    RedisModule_ReplyWithArray(ctx, len);
+    for(p = 0; p < len; ++p)
+        RedisModule_ReplyWithLongLong(ctx, res[p]);
+
+    RedisModule_Free(res);
+    return REDISMODULE_OK;
+}
 
+// Parses a trailing APPROX BITS option at argv[first] into the number of levels to descend.
+static int _parse_approx(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, int first, int *depth) {
+    long long bits;
+    *depth = 32;
+    if (argc == first)
+        return REDISMODULE_OK;
+    if (argc != first + 2 || strcasecmp(RedisModule_StringPtrLen(argv[first], NULL), "APPROX") != 0 ||
+            RedisModule_StringToLongLong(argv[first+1], &bits) != REDISMODULE_OK || bits < 0) {
+        RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        return REDISMODULE_ERR;
+    }
+    if (bits < *depth) *depth = bits;
     return REDISMODULE_OK;
 }
 
-// wvltr.prevvalue KEY FROM TO MIN MAX
-int WaveletTreePrevValue_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 6)
+// wvltr.quantile KEY FROM TO COUNT [APPROX BITS]
+int WaveletTreeQuantile_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 5 && argc != 7)
         return RedisModule_WrongArity(ctx);
 
-    long long from, to, min, max;
+    long long from, to, count;
     if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
     if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-    if (RedisModule_StringToLongLong(argv[4], &min) != REDISMODULE_OK) {
-        return REDISMODULE_ERR;
-    }
-    if (RedisModule_StringToLongLong(argv[5], &max) != REDISMODULE_OK) {
+    if (RedisModule_StringToLongLong(argv[4], &count) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
+    int depth;
+    if (_parse_approx(ctx, argv, argc, 5, &depth) != REDISMODULE_OK)
+        return REDISMODULE_OK;
 
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
 
@@ -451,162 +960,1492 @@ int WaveletTreePrevValue_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **a
     }
 
     wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
-    RedisModule_CloseKey(key);
+        RedisModule_CloseKey(key);
 
-    int32_t res = wt_prev_value(tree, from, to, min, max);
-    if (res == max)
-        RedisModule_ReplyWithNull(ctx);
-    else
-        RedisModule_ReplyWithLongLong(ctx, res);
+    reply_sink sink;
+    if (_cache_begin(&sink, ctx, argv, argc, tree))
+        return REDISMODULE_OK;
+
+    int32_t res, upper;
+    if (argc == 7) {
+        if (wt_quantile_approx(tree, from, to, count, depth, &res, &upper)) {
+            _sink_array(&sink, 2);
+            _sink_integer(&sink, res);
+            _sink_integer(&sink, upper);
+        }
+        else
+            _sink_null(&sink);
+    }
+    else if (wt_quantile(tree, from, to, count, &res))
+        _sink_integer(&sink, res);
+    else
+        _sink_null(&sink);
+
+    _cache_end(&sink);
+
+    return REDISMODULE_OK;
+}
+
+typedef struct quantile_arg {
+    size_t k;
+    int index;
+} quantile_arg;
+
+static int _quantile_arg_compare(const void *a, const void *b) {
+    size_t ka = ((const quantile_arg*)a)->k, kb = ((const quantile_arg*)b)->k;
+    return ka < kb ? -1 : ka > kb;
+}
+
+// wvltr.quantiles KEY FROM TO COUNT [COUNT ...]
+int WaveletTreeQuantiles_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 5)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    int i, n = argc - 4;
+    long long count;
+    quantile_arg *args = RedisModule_Calloc(n, sizeof(quantile_arg));
+    for(i = 0; i < n; ++i) {
+        if (RedisModule_StringToLongLong(argv[i+4], &count) != REDISMODULE_OK) {
+            RedisModule_Free(args);
+            return REDISMODULE_ERR;
+        }
+        args[i].k = count < 0 ? 0 : count;
+        args[i].index = i;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_Free(args);
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_Free(args);
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithArray(ctx, n);
+        for(i = 0; i < n; ++i)
+            RedisModule_ReplyWithNull(ctx);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    if (tree->len < to) to = tree->len;
+    if (from < 0 || to < from) to = from = 0;
+
+    // Answer all valid counts in a single traversal sorted by count
+    qsort(args, n, sizeof(quantile_arg), _quantile_arg_compare);
+
+    int lo = 0, hi = n;
+    while (lo < hi && args[lo].k == 0) ++lo;
+    while (lo < hi && to - from < args[hi-1].k) --hi;
+
+    size_t *ks = RedisModule_Calloc(n, sizeof(size_t));
+    int32_t *sorted = RedisModule_Calloc(n, sizeof(int32_t)), *res = RedisModule_Calloc(n, sizeof(int32_t));
+    char *found = RedisModule_Calloc(n, sizeof(char));
+    for(i = lo; i < hi; ++i)
+        ks[i] = args[i].k;
+    if (lo < hi && wt_quantiles(tree, from, to, ks + lo, hi - lo, sorted + lo)) {
+        for(i = lo; i < hi; ++i) {
+            res[args[i].index] = sorted[i];
+            found[args[i].index] = 1;
+        }
+    }
+
+    RedisModule_ReplyWithArray(ctx, n);
+    for(i = 0; i < n; ++i) {
+        if (found[i])
+            RedisModule_ReplyWithLongLong(ctx, res[i]);
+        else
+            RedisModule_ReplyWithNull(ctx);
+    }
+
+    RedisModule_Free(found);
+    RedisModule_Free(res);
+    RedisModule_Free(sorted);
+    RedisModule_Free(ks);
+    RedisModule_Free(args);
+    return REDISMODULE_OK;
+}
+
+// wvltr.rangefreq KEY FROM TO MIN MAX [APPROX BITS]
+int WaveletTreeRangeFreq_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 6 && argc != 8)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to, min, max;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &min) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[5], &max) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    int depth;
+    if (_parse_approx(ctx, argv, argc, 6, &depth) != REDISMODULE_OK)
+        return REDISMODULE_OK;
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        if (argc == 8) {
+            RedisModule_ReplyWithArray(ctx, 2);
+            RedisModule_ReplyWithLongLong(ctx, 0);
+        }
+        RedisModule_ReplyWithLongLong(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    if (argc == 8) {
+        int lower, upper;
+        wt_range_freq_approx(tree, from, to, min, max, depth, &lower, &upper);
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithLongLong(ctx, lower);
+        RedisModule_ReplyWithLongLong(ctx, upper);
+        return REDISMODULE_OK;
+    }
+    int res = wt_range_freq(tree, from, to, min, max);
+
+    RedisModule_CloseKey(key);
+    RedisModule_ReplyWithLongLong(ctx, res);
+    return REDISMODULE_OK;
+}
+
+// wvltr.rangehist KEY FROM TO EDGE EDGE [EDGE ...]
+int WaveletTreeRangeHist_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 6)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    int i, m = argc - 4;
+    long long edge;
+    int32_t *edges = RedisModule_Calloc(m, sizeof(int32_t));
+    for(i = 0; i < m; ++i) {
+        if (RedisModule_StringToLongLong(argv[i+4], &edge) != REDISMODULE_OK) {
+            RedisModule_Free(edges);
+            return REDISMODULE_ERR;
+        }
+        edges[i] = edge;
+        if (i && edges[i] < edges[i-1]) {
+            RedisModule_Free(edges);
+            return RedisModule_ReplyWithError(ctx, "ERR edges must be sorted in ascending order");
+        }
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_Free(edges);
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    int *counts = RedisModule_Calloc(m, sizeof(int));
+    if (type != REDISMODULE_KEYTYPE_EMPTY && 0 <= from && from < to)
+        wt_range_hist(RedisModule_ModuleTypeGetValue(key), from, to, edges, m, counts);
+    RedisModule_CloseKey(key);
+
+    RedisModule_ReplyWithArray(ctx, m - 1);
+    for(i = 0; i < m - 1; ++i)
+        RedisModule_ReplyWithLongLong(ctx, counts[i]);
+
+    RedisModule_Free(counts);
+    RedisModule_Free(edges);
+    return REDISMODULE_OK;
+}
+
+// wvltr.distinct KEY FROM TO
+int WaveletTreeDistinct_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 4)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithLongLong(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    if (!(tree->flags & WT_FLAG_DISTINCT))
+        return RedisModule_ReplyWithError(ctx, "ERR the wavelet tree was not built with DISTINCT");
+
+    int res = (from < 0 || to <= from) ? 0 : wt_range_distinct(tree, from, to);
+    RedisModule_ReplyWithLongLong(ctx, res);
+    return REDISMODULE_OK;
+}
+
+// wvltr.rangesum KEY FROM TO MIN MAX
+int WaveletTreeRangeSum_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 6)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to, min, max;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &min) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[5], &max) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithLongLong(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    if (!(tree->flags & WT_FLAG_SUMS))
+        return RedisModule_ReplyWithError(ctx, "ERR the wavelet tree was not built with SUMS");
+
+    long long res = (from < 0 || to <= from) ? 0 : wt_range_sum(tree, from, to, min, max);
+    RedisModule_ReplyWithLongLong(ctx, res);
+    return REDISMODULE_OK;
+}
+
+// wvltr.kthsum KEY FROM TO K
+int WaveletTreeKthSum_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 5)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to, k;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &k) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithLongLong(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    if (!(tree->flags & WT_FLAG_SUMS))
+        return RedisModule_ReplyWithError(ctx, "ERR the wavelet tree was not built with SUMS");
+
+    long long res = (from < 0 || to <= from || k <= 0) ? 0 : wt_kth_sum(tree, from, to, k);
+    RedisModule_ReplyWithLongLong(ctx, res);
+    return REDISMODULE_OK;
+}
+
+void _value_count_callback(void *user_data, int32_t value, int count) {
+    RedisModuleCtx *ctx = user_data;
+
+    RedisModule_ReplyWithArray(ctx, 2);
+    RedisModule_ReplyWithLongLong(ctx, value);
+    RedisModule_ReplyWithLongLong(ctx, count);
+}
+
+#define BUDGET_MAX_TIMEOUT (LLONG_MAX / 1000000)
+
+// Parses trailing MAXWORK N and TIMEOUT MS options at argv[first] and starts the budget.
+// Returns 1 if any was given, 0 if none and -1 on a syntax error.
+static int _parse_budget(RedisModuleString **argv, int argc, int first, wt_budget *budget) {
+    int i;
+    long long value, max_work = 0, timeout = 0;
+    for(i = first; i < argc; i += 2) {
+        const char *opt = RedisModule_StringPtrLen(argv[i], NULL);
+        if (i + 1 == argc || RedisModule_StringToLongLong(argv[i+1], &value) != REDISMODULE_OK || value <= 0)
+            return -1;
+        if (!strcasecmp(opt, "maxwork"))
+            max_work = value;
+        else if (!strcasecmp(opt, "timeout"))
+            // clamped so that the deadline in nanoseconds can't overflow
+            timeout = value < BUDGET_MAX_TIMEOUT ? value : BUDGET_MAX_TIMEOUT;
+        else
+            return -1;
+    }
+    wt_budget_init(budget, max_work, timeout);
+    return first < argc;
+}
+
+// wvltr.rangelist KEY FROM TO MIN MAX [MAXWORK N] [TIMEOUT MS]
+int WaveletTreeRangeList_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 6 || argc > 10)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to, min, max;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &min) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[5], &max) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    wt_budget budget;
+    int budgeted = _parse_budget(argv, argc, 6, &budget);
+    if (budgeted < 0)
+        return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        if (budgeted)
+            RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithArray(ctx, 0);
+        if (budgeted)
+            RedisModule_ReplyWithLongLong(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    // budgeted replies depend on timing and are never cached
+    reply_sink sink;
+    if (budgeted)
+        _sink_init(&sink, ctx);
+    else if (_cache_begin(&sink, ctx, argv, argc, tree))
+        return REDISMODULE_OK;
+
+    if (budgeted)
+        RedisModule_ReplyWithArray(ctx, 2);
+    _sink_array(&sink, REDISMODULE_POSTPONED_ARRAY_LEN);
+    int len = wt_range_list_budget(tree, from, to, min, max, budgeted ? &budget : NULL, _sink_value_count_callback, &sink);
+    _sink_set_array_length(&sink, len);
+    if (budgeted)
+        RedisModule_ReplyWithLongLong(ctx, budget.exhausted);
+    _cache_end(&sink);
+
+    return REDISMODULE_OK;
+}
+
+// wvltr.prevvalue KEY FROM TO MIN MAX
+int WaveletTreePrevValue_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 6)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to, min, max;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &min) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[5], &max) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithNull(ctx);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    int32_t res = wt_prev_value(tree, from, to, min, max);
+    if (res == max)
+        RedisModule_ReplyWithNull(ctx);
+    else
+        RedisModule_ReplyWithLongLong(ctx, res);
+
+    return REDISMODULE_OK;
+}
+
+// wvltr.nextvalue KEY FROM TO MIN MAX
+int WaveletTreeNextValue_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 6)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to, min, max;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &min) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[5], &max) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithNull(ctx);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    int32_t res = wt_next_value(tree, from, to, min, max);
+    if (res == max)
+        RedisModule_ReplyWithNull(ctx);
+    else
+        RedisModule_ReplyWithLongLong(ctx, res);
+
+    return REDISMODULE_OK;
+}
+
+// wvltr.topk KEY FROM TO K [MAXWORK N] [TIMEOUT MS]
+int WaveletTreeTopK_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 5 || argc > 9)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to, k;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &k) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    wt_budget budget;
+    int budgeted = _parse_budget(argv, argc, 5, &budget);
+    if (budgeted < 0)
+        return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        if (budgeted)
+            RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithArray(ctx, 0);
+        if (budgeted)
+            RedisModule_ReplyWithLongLong(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    // budgeted replies depend on timing and are never cached
+    reply_sink sink;
+    if (budgeted)
+        _sink_init(&sink, ctx);
+    else if (_cache_begin(&sink, ctx, argv, argc, tree))
+        return REDISMODULE_OK;
+
+    if (budgeted)
+        RedisModule_ReplyWithArray(ctx, 2);
+    _sink_array(&sink, REDISMODULE_POSTPONED_ARRAY_LEN);
+    int len = wt_topk_budget(tree, from, to, k, budgeted ? &budget : NULL, _sink_value_count_callback, &sink);
+    _sink_set_array_length(&sink, len);
+    if (budgeted)
+        RedisModule_ReplyWithLongLong(ctx, budget.exhausted);
+    _cache_end(&sink);
+
+    return REDISMODULE_OK;
+}
+
+// wvltr.slidingquantile KEY FROM TO WINDOW STEP COUNT
+int WaveletTreeSlidingQuantile_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 7)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to, window, step, count;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &window) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[5], &step) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[6], &count) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY || from < 0 || to < from || window <= 0 || step <= 0) {
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithArray(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    size_t w, n = wt_sliding_windows(tree, from, to, window, step);
+    RedisModule_ReplyWithArray(ctx, n);
+    if (!n) return REDISMODULE_OK;
+
+    int32_t *res = RedisModule_Calloc(n, sizeof(int32_t));
+    if (wt_sliding_quantile(tree, from, to, window, step, count < 0 ? 0 : count, res)) {
+        for(w = 0; w < n; ++w)
+            RedisModule_ReplyWithLongLong(ctx, res[w]);
+    }
+    else {
+        for(w = 0; w < n; ++w)
+            RedisModule_ReplyWithNull(ctx);
+    }
+    RedisModule_Free(res);
+
+    return REDISMODULE_OK;
+}
+
+typedef struct sliding_reply {
+    RedisModuleCtx *ctx;
+    long len;
+} sliding_reply;
+
+void _sliding_window_callback(void *user_data, size_t window) {
+    sliding_reply *reply = user_data;
+
+    if (window)
+        RedisModule_ReplySetArrayLength(reply->ctx, reply->len);
+    RedisModule_ReplyWithArray(reply->ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    reply->len = 0;
+}
+
+void _sliding_value_count_callback(void *user_data, int32_t value, int count) {
+    sliding_reply *reply = user_data;
+
+    _value_count_callback(reply->ctx, value, count);
+    ++reply->len;
+}
+
+// wvltr.slidingtopk KEY FROM TO WINDOW STEP K
+int WaveletTreeSlidingTopK_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 7)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to, window, step, k;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &window) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[5], &step) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[6], &k) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY || from < 0 || to < from || window <= 0 || step <= 0) {
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithArray(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    size_t n = wt_sliding_windows(tree, from, to, window, step);
+    RedisModule_ReplyWithArray(ctx, n);
+    if (!n) return REDISMODULE_OK;
+
+    sliding_reply reply = { ctx, 0 };
+    wt_sliding_topk(tree, from, to, window, step, k < 0 ? 0 : k,
+        _sliding_window_callback, _sliding_value_count_callback, &reply);
+    RedisModule_ReplySetArrayLength(ctx, reply.len);
+
+    return REDISMODULE_OK;
+}
+
+// wvltr.rangemink KEY FROM TO K [MAXWORK N] [TIMEOUT MS]
+int WaveletTreeRangeMinK_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 5 || argc > 9)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to, k;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &k) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    wt_budget budget;
+    int budgeted = _parse_budget(argv, argc, 5, &budget);
+    if (budgeted < 0)
+        return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        if (budgeted)
+            RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithArray(ctx, 0);
+        if (budgeted)
+            RedisModule_ReplyWithLongLong(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    if (budgeted)
+        RedisModule_ReplyWithArray(ctx, 2);
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    int len = wt_range_mink_budget(tree, from, to, k, budgeted ? &budget : NULL, _value_count_callback, ctx);
+    RedisModule_ReplySetArrayLength(ctx, len);
+    if (budgeted)
+        RedisModule_ReplyWithLongLong(ctx, budget.exhausted);
+
+    return REDISMODULE_OK;
+}
+
+// wvltr.rangemaxk KEY FROM TO K [MAXWORK N] [TIMEOUT MS]
+int WaveletTreeRangeMaxK_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 5 || argc > 9)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to, k;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &k) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    wt_budget budget;
+    int budgeted = _parse_budget(argv, argc, 5, &budget);
+    if (budgeted < 0)
+        return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        if (budgeted)
+            RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithArray(ctx, 0);
+        if (budgeted)
+            RedisModule_ReplyWithLongLong(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    if (budgeted)
+        RedisModule_ReplyWithArray(ctx, 2);
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    int len = wt_range_maxk_budget(tree, from, to, k, budgeted ? &budget : NULL, _value_count_callback, ctx);
+    RedisModule_ReplySetArrayLength(ctx, len);
+    if (budgeted)
+        RedisModule_ReplyWithLongLong(ctx, budget.exhausted);
 
     return REDISMODULE_OK;
 }
 
-// wvltr.nextvalue KEY FROM TO MIN MAX
-int WaveletTreeNextValue_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+// Parses FROM TO pairs starting at argv[first] into a newly allocated array.
+static wt_interval *_parse_intervals(RedisModuleString **argv, int argc, int first, size_t *m) {
+    int i;
+    long long from, to;
+    wt_interval *ranges = RedisModule_Calloc((argc - first) / 2 + 1, sizeof(wt_interval));
+    for(i = first, *m = 0; i + 1 < argc; i += 2, ++*m) {
+        if (RedisModule_StringToLongLong(argv[i], &from) != REDISMODULE_OK ||
+                RedisModule_StringToLongLong(argv[i+1], &to) != REDISMODULE_OK) {
+            RedisModule_Free(ranges);
+            return NULL;
+        }
+        // Clamped so that negative bounds don't wrap around as sizes
+        if (from < 0) from = 0;
+        if (to < 0) to = 0;
+        ranges[*m].i = from;
+        ranges[*m].j = to;
+    }
+    return ranges;
+}
+
+// wvltr.mquantile KEY COUNT FROM TO [FROM TO ...]
+int WaveletTreeMultiQuantile_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 5 || (argc & 1) == 0)
+        return RedisModule_WrongArity(ctx);
+
+    long long count;
+    if (RedisModule_StringToLongLong(argv[2], &count) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    size_t m;
+    wt_interval *ranges = _parse_intervals(argv, argc, 3, &m);
+    if (!ranges)
+        return REDISMODULE_ERR;
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        RedisModule_Free(ranges);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        RedisModule_Free(ranges);
+        RedisModule_ReplyWithNull(ctx);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    int32_t res;
+    if (wt_quantile_multi(tree, ranges, m, count, &res))
+        RedisModule_ReplyWithLongLong(ctx, res);
+    else
+        RedisModule_ReplyWithNull(ctx);
+
+    RedisModule_Free(ranges);
+    return REDISMODULE_OK;
+}
+
+// wvltr.mrangefreq KEY MIN MAX FROM TO [FROM TO ...]
+int WaveletTreeMultiRangeFreq_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 6 || (argc & 1))
+        return RedisModule_WrongArity(ctx);
+
+    long long min, max;
+    if (RedisModule_StringToLongLong(argv[2], &min) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &max) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    size_t m;
+    wt_interval *ranges = _parse_intervals(argv, argc, 4, &m);
+    if (!ranges)
+        return REDISMODULE_ERR;
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        RedisModule_Free(ranges);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        RedisModule_Free(ranges);
+        RedisModule_ReplyWithLongLong(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    int res = wt_range_freq_multi(tree, ranges, m, min, max);
+
+    RedisModule_CloseKey(key);
+    RedisModule_Free(ranges);
+    RedisModule_ReplyWithLongLong(ctx, res);
+    return REDISMODULE_OK;
+}
+
+// wvltr.mtopk KEY K FROM TO [FROM TO ...]
+int WaveletTreeMultiTopK_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 5 || (argc & 1) == 0)
+        return RedisModule_WrongArity(ctx);
+
+    long long k;
+    if (RedisModule_StringToLongLong(argv[2], &k) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    size_t m;
+    wt_interval *ranges = _parse_intervals(argv, argc, 3, &m);
+    if (!ranges)
+        return REDISMODULE_ERR;
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        RedisModule_Free(ranges);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        RedisModule_Free(ranges);
+        RedisModule_ReplyWithArray(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    int len = wt_topk_multi(tree, ranges, m, k, _value_count_callback, ctx);
+    RedisModule_ReplySetArrayLength(ctx, len);
+
+    RedisModule_Free(ranges);
+    return REDISMODULE_OK;
+}
+
+void _value_counts_callback(void *user_data, int32_t value, int count1, int count2) {
+    RedisModuleCtx *ctx = user_data;
+
+    RedisModule_ReplyWithArray(ctx, 3);
+    RedisModule_ReplyWithLongLong(ctx, value);
+    RedisModule_ReplyWithLongLong(ctx, count1);
+    RedisModule_ReplyWithLongLong(ctx, count2);
+}
+
+// wvltr.intersect KEY FROM1 TO1 FROM2 TO2
+int WaveletTreeIntersect_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 6)
+        return RedisModule_WrongArity(ctx);
+
+    long long from1, to1, from2, to2;
+    if (RedisModule_StringToLongLong(argv[2], &from1) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to1) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &from2) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[5], &to2) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithArray(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    int len = wt_range_intersect(tree, from1, to1, from2, to2, _value_counts_callback, ctx);
+    RedisModule_ReplySetArrayLength(ctx, len);
+
+    return REDISMODULE_OK;
+}
+
+// wvltr.rangeheavy KEY FROM TO MINFREQ
+int WaveletTreeRangeHeavy_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 5)
+        return RedisModule_WrongArity(ctx);
+
+    long long from, to, minfreq;
+    double fraction = 0;
+    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &minfreq) != REDISMODULE_OK) {
+        // a fraction of the range length, e.g. 0.01
+        if (RedisModule_StringToDouble(argv[4], &fraction) != REDISMODULE_OK || fraction <= 0 || fraction > 1)
+            return RedisModule_ReplyWithError(ctx, "ERR minfreq must be a positive integer or a fraction in (0, 1]");
+        minfreq = 0;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithArray(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    // The fraction is of the part of the range inside the tree
+    if (from < 0) from = 0;
+    if (tree->len < to) to = tree->len;
+    if (fraction && from < to) {
+        minfreq = (long long)(fraction * (to - from));
+        if (minfreq < fraction * (to - from)) ++minfreq;
+    }
+    if (minfreq < 1)
+        minfreq = 1;
+
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    int len = wt_range_heavy(tree, from, to, minfreq, _value_count_callback, ctx);
+    RedisModule_ReplySetArrayLength(ctx, len);
+
+    return REDISMODULE_OK;
+}
+
+static void _reply_level_usage(RedisModuleCtx *ctx, const wt_level_usage *usage) {
+    RedisModule_ReplyWithSimpleString(ctx, "nodes");
+    RedisModule_ReplyWithLongLong(ctx, usage->nodes);
+    RedisModule_ReplyWithSimpleString(ctx, "bits");
+    RedisModule_ReplyWithLongLong(ctx, usage->bits);
+    RedisModule_ReplyWithSimpleString(ctx, "headers");
+    RedisModule_ReplyWithLongLong(ctx, usage->headers);
+    RedisModule_ReplyWithSimpleString(ctx, "bs");
+    RedisModule_ReplyWithLongLong(ctx, usage->bs);
+    RedisModule_ReplyWithSimpleString(ctx, "rd");
+    RedisModule_ReplyWithLongLong(ctx, usage->rd);
+    RedisModule_ReplyWithSimpleString(ctx, "sums");
+    RedisModule_ReplyWithLongLong(ctx, usage->sums);
+}
+
+// wvltr.info KEY
+int WaveletTreeInfo_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 2)
+        return RedisModule_WrongArity(ctx);
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
+    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    wt_usage *usage = RedisModule_Alloc(sizeof(wt_usage));
+    wt_memory_report(tree, usage);
+
+    size_t d;
+    RedisModule_ReplyWithArray(ctx, 20);
+    RedisModule_ReplyWithSimpleString(ctx, "len");
+    RedisModule_ReplyWithLongLong(ctx, usage->len);
+    RedisModule_ReplyWithSimpleString(ctx, "distinct");
+    RedisModule_ReplyWithLongLong(ctx, usage->distinct);
+    RedisModule_ReplyWithSimpleString(ctx, "height");
+    RedisModule_ReplyWithLongLong(ctx, usage->height);
+    RedisModule_ReplyWithSimpleString(ctx, "nodes");
+    RedisModule_ReplyWithLongLong(ctx, usage->nodes);
+    RedisModule_ReplyWithSimpleString(ctx, "bytes");
+    RedisModule_ReplyWithLongLong(ctx, usage->bytes);
+    RedisModule_ReplyWithSimpleString(ctx, "bits_per_element");
+    RedisModule_ReplyWithDouble(ctx, usage->len ? usage->bytes * 8.0 / usage->len : 0);
+    RedisModule_ReplyWithSimpleString(ctx, "flags");
+    RedisModule_ReplyWithLongLong(ctx, tree->flags);
+    RedisModule_ReplyWithSimpleString(ctx, "aux");
+    RedisModule_ReplyWithLongLong(ctx, usage->aux);
+    RedisModule_ReplyWithSimpleString(ctx, "components");
+    RedisModule_ReplyWithArray(ctx, 12);
+    _reply_level_usage(ctx, &usage->total);
+    RedisModule_ReplyWithSimpleString(ctx, "levels");
+    RedisModule_ReplyWithArray(ctx, usage->height + 1);
+    for(d = 0; d <= usage->height; ++d) {
+        RedisModule_ReplyWithArray(ctx, 14);
+        RedisModule_ReplyWithSimpleString(ctx, "depth");
+        RedisModule_ReplyWithLongLong(ctx, d);
+        _reply_level_usage(ctx, &usage->levels[d]);
+    }
+
+    RedisModule_Free(usage);
+    return REDISMODULE_OK;
+}
+
+// wvltr.pointbuild KEY X Y [X Y ...]
+int PointGridBuild_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 4 || (argc & 1))
+        return RedisModule_WrongArity(ctx);
+
+    int i, len = (argc - 2) >> 1;
+    long long x, y;
+    int32_t *xs = RedisModule_Calloc(len, sizeof(int32_t));
+    int32_t *ys = RedisModule_Calloc(len, sizeof(int32_t));
+    for(i = 0; i < len; ++i) {
+        if (RedisModule_StringToLongLong(argv[2+(i<<1)], &x) != REDISMODULE_OK ||
+                RedisModule_StringToLongLong(argv[3+(i<<1)], &y) != REDISMODULE_OK) {
+            RedisModule_Free(xs);
+            RedisModule_Free(ys);
+            return REDISMODULE_ERR;
+        }
+        if (x < INT32_MIN || INT32_MAX < x || y < INT32_MIN || INT32_MAX < y) {
+            RedisModule_Free(xs);
+            RedisModule_Free(ys);
+            return RedisModule_ReplyWithError(ctx, "ERR coordinates must be 32-bit integers");
+        }
+        xs[i] = x;
+        ys[i] = y;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != PointGridType) {
+        RedisModule_Free(xs);
+        RedisModule_Free(ys);
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    wt_grid *grid = wt_grid_new();
+    wt_grid_build(grid, xs, ys, len);
+
+    RedisModule_ModuleTypeSetValue(key, PointGridType, grid);
+
+    int ret = RedisModule_ReplyWithSimpleString(ctx, "OK");
+
+    RedisModule_Free(xs);
+    RedisModule_Free(ys);
+    RedisModule_CloseKey(key);
+
+    if (ret == REDISMODULE_OK)
+        RedisModule_ReplicateVerbatim(ctx);
+
+    return ret;
+}
+
+// wvltr.pointset KEY BYTES
+int PointGridSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3)
+        return RedisModule_WrongArity(ctx);
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != PointGridType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    int i, j;
+    size_t len;
+    const unsigned char *buf = (const unsigned char *)RedisModule_StringPtrLen(argv[2], &len);
+
+    len >>= 3;
+    int32_t *xs = RedisModule_Calloc(len + 1, sizeof(int32_t));
+    int32_t *ys = RedisModule_Calloc(len + 1, sizeof(int32_t));
+    for (i = 0; i < len; ++i) {
+        uint32_t x = 0, y = 0;
+        for (j = 0; j < 4; ++j) {
+            x = (x << 8) | buf[(i<<3)+j];
+            y = (y << 8) | buf[(i<<3)+4+j];
+        }
+        xs[i] = x;
+        ys[i] = y;
+    }
+
+    wt_grid *grid = wt_grid_new();
+    wt_grid_build(grid, xs, ys, len);
+
+    RedisModule_ModuleTypeSetValue(key, PointGridType, grid);
+
+    int ret = RedisModule_ReplyWithSimpleString(ctx, "OK");
+
+    RedisModule_Free(xs);
+    RedisModule_Free(ys);
+    RedisModule_CloseKey(key);
+
+    if (ret == REDISMODULE_OK)
+        RedisModule_ReplicateVerbatim(ctx);
+
+    return ret;
+}
+
+// wvltr.pointcount KEY XMIN XMAX YMIN YMAX
+int PointGridCount_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     if (argc != 6)
         return RedisModule_WrongArity(ctx);
 
-    long long from, to, min, max;
-    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+    long long x1, x2, y1, y2;
+    if (RedisModule_StringToLongLong(argv[2], &x1) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+    if (RedisModule_StringToLongLong(argv[3], &x2) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-    if (RedisModule_StringToLongLong(argv[4], &min) != REDISMODULE_OK) {
+    if (RedisModule_StringToLongLong(argv[4], &y1) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-    if (RedisModule_StringToLongLong(argv[5], &max) != REDISMODULE_OK) {
+    if (RedisModule_StringToLongLong(argv[5], &y2) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
 
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
 
     int type = RedisModule_KeyType(key);
-    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != PointGridType) {
         RedisModule_CloseKey(key);
         return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
     if (type == REDISMODULE_KEYTYPE_EMPTY) {
         RedisModule_CloseKey(key);
-        RedisModule_ReplyWithNull(ctx);
+        RedisModule_ReplyWithLongLong(ctx, 0);
         return REDISMODULE_OK;
     }
 
-    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    wt_grid *grid = RedisModule_ModuleTypeGetValue(key);
+    int res = wt_grid_count(grid, x1, x2, y1, y2);
+
     RedisModule_CloseKey(key);
+    RedisModule_ReplyWithLongLong(ctx, res);
+    return REDISMODULE_OK;
+}
 
-    int32_t res = wt_next_value(tree, from, to, min, max);
-    if (res == max)
-        RedisModule_ReplyWithNull(ctx);
-    else
-        RedisModule_ReplyWithLongLong(ctx, res);
+void _point_callback(void *user_data, int32_t x, int32_t y) {
+    RedisModuleCtx *ctx = user_data;
 
-    return REDISMODULE_OK;
+    RedisModule_ReplyWithArray(ctx, 2);
+    RedisModule_ReplyWithLongLong(ctx, x);
+    RedisModule_ReplyWithLongLong(ctx, y);
 }
 
-// wvltr.topk KEY FROM TO K
-int WaveletTreeTopK_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 5)
+// wvltr.pointrange KEY XMIN XMAX YMIN YMAX CURSOR COUNT
+int PointGridRange_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 8)
         return RedisModule_WrongArity(ctx);
 
-    long long from, to, k;
-    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+    long long x1, x2, y1, y2, cursor, count;
+    if (RedisModule_StringToLongLong(argv[2], &x1) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+    if (RedisModule_StringToLongLong(argv[3], &x2) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-    if (RedisModule_StringToLongLong(argv[4], &k) != REDISMODULE_OK) {
+    if (RedisModule_StringToLongLong(argv[4], &y1) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[5], &y2) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[6], &cursor) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
+    if (RedisModule_StringToLongLong(argv[7], &count) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (cursor < 0) cursor = 0;
+    if (count < 0) count = 0;
 
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
 
     int type = RedisModule_KeyType(key);
-    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != PointGridType) {
         RedisModule_CloseKey(key);
         return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
+    RedisModule_ReplyWithArray(ctx, 2);
     if (type == REDISMODULE_KEYTYPE_EMPTY) {
         RedisModule_CloseKey(key);
+        RedisModule_ReplyWithLongLong(ctx, 0);
         RedisModule_ReplyWithArray(ctx, 0);
         return REDISMODULE_OK;
     }
 
-    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    wt_grid *grid = RedisModule_ModuleTypeGetValue(key);
     RedisModule_CloseKey(key);
 
+    // The next cursor is the offset of the first point not yet returned,
+    // or 0 once the rectangle has been exhausted.
+    int total = wt_grid_count(grid, x1, x2, y1, y2);
+    long long next = cursor + count < total ? cursor + count : 0;
+    RedisModule_ReplyWithLongLong(ctx, next);
+
     RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
-    int len = wt_topk(tree, from, to, k, _value_count_callback, ctx);
+    size_t len = wt_grid_report(grid, x1, x2, y1, y2, cursor, count, _point_callback, ctx);
     RedisModule_ReplySetArrayLength(ctx, len);
 
     return REDISMODULE_OK;
 }
 
-// wvltr.rangemink KEY FROM TO K
-int WaveletTreeRangeMinK_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 5)
+// wvltr.pointnearest KEY XMIN XMAX Y K
+int PointGridNearest_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 6)
         return RedisModule_WrongArity(ctx);
 
-    long long from, to, k;
-    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
+    long long x1, x2, y, k;
+    if (RedisModule_StringToLongLong(argv[2], &x1) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
+    if (RedisModule_StringToLongLong(argv[3], &x2) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-    if (RedisModule_StringToLongLong(argv[4], &k) != REDISMODULE_OK) {
+    if (RedisModule_StringToLongLong(argv[4], &y) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[5], &k) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
 
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
 
     int type = RedisModule_KeyType(key);
-    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != PointGridType) {
         RedisModule_CloseKey(key);
         return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
-    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    if (type == REDISMODULE_KEYTYPE_EMPTY || k <= 0) {
         RedisModule_CloseKey(key);
         RedisModule_ReplyWithArray(ctx, 0);
         return REDISMODULE_OK;
     }
 
-    wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
+    wt_grid *grid = RedisModule_ModuleTypeGetValue(key);
     RedisModule_CloseKey(key);
 
     RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
-    int len = wt_range_mink(tree, from, to, k, _value_count_callback, ctx);
+    size_t len = wt_grid_nearest(grid, x1, x2, y, k, _point_callback, ctx);
     RedisModule_ReplySetArrayLength(ctx, len);
 
     return REDISMODULE_OK;
 }
 
-// wvltr.rangemaxk KEY FROM TO K
-int WaveletTreeRangeMaxK_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 5)
+// wvltr.fmbuild KEY STRING
+int FMIndexBuild_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3)
         return RedisModule_WrongArity(ctx);
 
-    long long from, to, k;
-    if (RedisModule_StringToLongLong(argv[2], &from) != REDISMODULE_OK) {
-        return REDISMODULE_ERR;
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != FMIndexType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
-    if (RedisModule_StringToLongLong(argv[3], &to) != REDISMODULE_OK) {
-        return REDISMODULE_ERR;
+
+    size_t len;
+    const char *text = RedisModule_StringPtrLen(argv[2], &len);
+    if (INT32_MAX <= len) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, "ERR string is too long");
     }
-    if (RedisModule_StringToLongLong(argv[4], &k) != REDISMODULE_OK) {
+
+    fm_index *fm = fm_new();
+    fm_build(fm, (const unsigned char *)text, len);
+
+    RedisModule_ModuleTypeSetValue(key, FMIndexType, fm);
+
+    int ret = RedisModule_ReplyWithSimpleString(ctx, "OK");
+
+    RedisModule_CloseKey(key);
+
+    if (ret == REDISMODULE_OK)
+        RedisModule_ReplicateVerbatim(ctx);
+
+    return ret;
+}
+
+// wvltr.fmcount KEY PATTERN
+int FMIndexCount_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3)
+        return RedisModule_WrongArity(ctx);
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != FMIndexType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        RedisModule_ReplyWithLongLong(ctx, 0);
+        return REDISMODULE_OK;
+    }
+
+    size_t len;
+    const char *pattern = RedisModule_StringPtrLen(argv[2], &len);
+
+    fm_index *fm = RedisModule_ModuleTypeGetValue(key);
+    size_t res = fm_count(fm, (const unsigned char *)pattern, len);
+
+    RedisModule_CloseKey(key);
+    RedisModule_ReplyWithLongLong(ctx, res);
+    return REDISMODULE_OK;
+}
+
+static int _position_compare(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// wvltr.fmlocate KEY PATTERN [COUNT]
+int FMIndexLocate_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3 && argc != 4)
+        return RedisModule_WrongArity(ctx);
+
+    long long limit = -1;
+    if (argc == 4 && RedisModule_StringToLongLong(argv[3], &limit) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
 
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
 
     int type = RedisModule_KeyType(key);
-    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != FMIndexType) {
         RedisModule_CloseKey(key);
         return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
@@ -617,25 +2456,323 @@ int WaveletTreeRangeMaxK_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **a
         return REDISMODULE_OK;
     }
 
+    size_t len;
+    const char *pattern = RedisModule_StringPtrLen(argv[2], &len);
+
+    fm_index *fm = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    size_t i, n = fm_count(fm, (const unsigned char *)pattern, len);
+    if (0 <= limit && limit < n) n = limit;
+
+    // Only the first count matches in suffix array order are located, so that
+    // count bounds the work, and they are sorted afterwards
+    size_t *positions = RedisModule_Calloc(n + 1, sizeof(size_t));
+    n = fm_locate(fm, (const unsigned char *)pattern, len, n, positions);
+    qsort(positions, n, sizeof(size_t), _position_compare);
+
+    RedisModule_ReplyWithArray(ctx, n);
+    for(i = 0; i < n; ++i)
+        RedisModule_ReplyWithLongLong(ctx, positions[i]);
+
+    RedisModule_Free(positions);
+    return REDISMODULE_OK;
+}
+
+/*
+ * Self-benchmark
+ */
+
+#define BENCH_MAX_ITERATIONS 10000000
+// The server is blocked while benchmarking, so runs stop after a second
+#define BENCH_MAX_NS 1000000000ULL
+#define BENCH_TOPK 10
+
+static const char *BenchOps[] = { "access", "rank", "select", "quantile", "rangefreq", "topk", NULL };
+
+static uint64_t _bench_random(uint64_t *state) {
+    // splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void _bench_range(uint64_t *state, size_t len, size_t *i, size_t *j) {
+    *i = _bench_random(state) % len;
+    *j = *i + 1 + _bench_random(state) % (len - *i);
+}
+
+static void _bench_callback(void *user_data, int32_t value, int count) {
+    *(long long*)user_data += count;
+}
+
+static int _bench_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Times up to iterations random queries of BenchOps[op] on a non-empty tree
+// within BENCH_MAX_NS and returns how many ran. Arguments are drawn from the
+// data so that ranks, selects and value ranges hit real values, and outside
+// of the timed region.
+static size_t _bench_run(const wt_tree *tree, int op, size_t iterations, uint64_t seed, uint64_t *latencies) {
+    size_t n, i, j, occurrence = 0, len = tree->len;
+    int32_t v, w;
+    long long sink = 0;
+    uint64_t start, deadline = wt_clock_ns() + BENCH_MAX_NS;
+
+    for(n = 0; n < iterations && (n == 0 || wt_clock_ns() < deadline); ++n) {
+        wt_access(tree, _bench_random(&seed) % len, &v);
+        wt_access(tree, _bench_random(&seed) % len, &w);
+        _bench_range(&seed, len, &i, &j);
+        if (op == 2)
+            occurrence = 1 + _bench_random(&seed) % wt_rank(tree, v, len);
+
+        start = wt_clock_ns();
+        switch (op) {
+        case 0:
+            sink += wt_access(tree, i, &v);
+            break;
+        case 1:
+            sink += wt_rank(tree, v, j);
+            break;
+        case 2:
+            sink += wt_select(tree, v, occurrence);
+            break;
+        case 3:
+            sink += wt_quantile(tree, i, j, 1 + _bench_random(&seed) % (j - i), &v);
+            break;
+        case 4:
+            sink += wt_range_freq(tree, i, j, v < w ? v : w, v < w ? w : v);
+            break;
+        case 5:
+            sink += wt_topk(tree, i, j, BENCH_TOPK, _bench_callback, &sink);
+            break;
+        }
+        latencies[n] = wt_clock_ns() - start;
+    }
+    return n;
+}
+
+// wvltr.bench KEY OP ITERATIONS [SEED]
+int WaveletTreeBench_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 4 && argc != 5)
+        return RedisModule_WrongArity(ctx);
+
+    long long iterations, seed = 1;
+    if (RedisModule_StringToLongLong(argv[3], &iterations) != REDISMODULE_OK)
+        return REDISMODULE_ERR;
+    if (argc == 5 && RedisModule_StringToLongLong(argv[4], &seed) != REDISMODULE_OK)
+        return REDISMODULE_ERR;
+    if (iterations < 1 || BENCH_MAX_ITERATIONS < iterations)
+        return RedisModule_ReplyWithError(ctx, "ERR iterations out of range");
+
+    int op;
+    const char *name = RedisModule_StringPtrLen(argv[2], NULL);
+    for(op = 0; BenchOps[op] && strcasecmp(BenchOps[op], name); ++op);
+    if (!BenchOps[op])
+        return RedisModule_ReplyWithError(ctx, "ERR unknown operation");
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != WaveletTreeType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
     wt_tree *tree = RedisModule_ModuleTypeGetValue(key);
     RedisModule_CloseKey(key);
 
-    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
-    int len = wt_range_maxk(tree, from, to, k, _value_count_callback, ctx);
-    RedisModule_ReplySetArrayLength(ctx, len);
+    if (tree->len == 0)
+        return RedisModule_ReplyWithNull(ctx);
+
+    uint64_t *latencies = RedisModule_Calloc(iterations, sizeof(uint64_t));
+    iterations = _bench_run(tree, op, iterations, seed, latencies);
+
+    uint64_t total = 0;
+    long long n;
+    for(n = 0; n < iterations; ++n)
+        total += latencies[n];
+    qsort(latencies, iterations, sizeof(uint64_t), _bench_compare);
+
+    RedisModule_ReplyWithArray(ctx, 16);
+    RedisModule_ReplyWithSimpleString(ctx, "iterations");
+    RedisModule_ReplyWithLongLong(ctx, iterations);
+    RedisModule_ReplyWithSimpleString(ctx, "total_ns");
+    RedisModule_ReplyWithLongLong(ctx, total);
+    RedisModule_ReplyWithSimpleString(ctx, "ops_per_sec");
+    RedisModule_ReplyWithLongLong(ctx, total ? iterations * 1000000000ULL / total : 0);
+    RedisModule_ReplyWithSimpleString(ctx, "mean_ns");
+    RedisModule_ReplyWithLongLong(ctx, total / iterations);
+    RedisModule_ReplyWithSimpleString(ctx, "p50_ns");
+    RedisModule_ReplyWithLongLong(ctx, latencies[iterations / 2]);
+    RedisModule_ReplyWithSimpleString(ctx, "p90_ns");
+    RedisModule_ReplyWithLongLong(ctx, latencies[iterations * 9 / 10]);
+    RedisModule_ReplyWithSimpleString(ctx, "p99_ns");
+    RedisModule_ReplyWithLongLong(ctx, latencies[iterations * 99 / 100]);
+    RedisModule_ReplyWithSimpleString(ctx, "max_ns");
+    RedisModule_ReplyWithLongLong(ctx, latencies[iterations - 1]);
+
+    RedisModule_Free(latencies);
+    return REDISMODULE_OK;
+}
+
+// wvltr.stats [RESET]
+int WaveletTreeStats_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc > 2)
+        return RedisModule_WrongArity(ctx);
 
+#ifdef WT_STATS
+    int c, b;
+    if (argc == 2) {
+        if (strcasecmp(RedisModule_StringPtrLen(argv[1], NULL), "reset"))
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        wt_stats_reset();
+        for(c = 0; c < CommandStatsLen; ++c)
+            memset(&CommandStats[c].latency, 0, sizeof(wt_histogram));
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+
+    // counters are read before the reply adds to them
+    wt_stats counters = wt_counters;
+    RedisModule_ReplyWithArray(ctx, 12);
+    RedisModule_ReplyWithSimpleString(ctx, "nodes_visited");
+    RedisModule_ReplyWithLongLong(ctx, counters.nodes_visited);
+    RedisModule_ReplyWithSimpleString(ctx, "fid_rank");
+    RedisModule_ReplyWithLongLong(ctx, counters.fid_rank_calls);
+    RedisModule_ReplyWithSimpleString(ctx, "fid_select");
+    RedisModule_ReplyWithLongLong(ctx, counters.fid_select_calls);
+    RedisModule_ReplyWithSimpleString(ctx, "heap_pushes");
+    RedisModule_ReplyWithLongLong(ctx, counters.heap_pushes);
+    RedisModule_ReplyWithSimpleString(ctx, "reply_elements");
+    RedisModule_ReplyWithLongLong(ctx, counters.reply_elements);
+
+    RedisModule_ReplyWithSimpleString(ctx, "commands");
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    long n = 0;
+    for(c = 0; c < CommandStatsLen; ++c) {
+        const wt_histogram *latency = &CommandStats[c].latency;
+        if (!latency->count)
+            continue;
+        ++n;
+        RedisModule_ReplyWithArray(ctx, 11);
+        RedisModule_ReplyWithSimpleString(ctx, CommandStats[c].name);
+        RedisModule_ReplyWithSimpleString(ctx, "calls");
+        RedisModule_ReplyWithLongLong(ctx, latency->count);
+        RedisModule_ReplyWithSimpleString(ctx, "total_ns");
+        RedisModule_ReplyWithLongLong(ctx, latency->total);
+        RedisModule_ReplyWithSimpleString(ctx, "p50_ns");
+        RedisModule_ReplyWithLongLong(ctx, wt_histogram_percentile(latency, 50));
+        RedisModule_ReplyWithSimpleString(ctx, "p99_ns");
+        RedisModule_ReplyWithLongLong(ctx, wt_histogram_percentile(latency, 99));
+        RedisModule_ReplyWithSimpleString(ctx, "histogram");
+
+        // upper bound in ns and count of each non-empty bucket
+        long m = 0;
+        RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+        for(b = 0; b < WT_HISTOGRAM_BUCKETS; ++b) {
+            if (!latency->buckets[b])
+                continue;
+            RedisModule_ReplyWithLongLong(ctx, wt_histogram_bucket_upper(b));
+            RedisModule_ReplyWithLongLong(ctx, latency->buckets[b]);
+            m += 2;
+        }
+        RedisModule_ReplySetArrayLength(ctx, m);
+    }
+    RedisModule_ReplySetArrayLength(ctx, n);
     return REDISMODULE_OK;
+#else
+    return RedisModule_ReplyWithError(ctx, "ERR statistics are disabled, build the module with make STATS=1");
+#endif
+}
+
+// wvltr.cache INFO | RESET | SIZE BYTES
+int WaveletTreeCache_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 2)
+        return RedisModule_WrongArity(ctx);
+
+    const char *sub = RedisModule_StringPtrLen(argv[1], NULL);
+    if (!strcasecmp(sub, "info") && argc == 2) {
+        RedisModule_ReplyWithArray(ctx, 14);
+        RedisModule_ReplyWithSimpleString(ctx, "capacity");
+        RedisModule_ReplyWithLongLong(ctx, ResultCache->capacity);
+        RedisModule_ReplyWithSimpleString(ctx, "used");
+        RedisModule_ReplyWithLongLong(ctx, ResultCache->used);
+        RedisModule_ReplyWithSimpleString(ctx, "entries");
+        RedisModule_ReplyWithLongLong(ctx, ResultCache->len);
+        RedisModule_ReplyWithSimpleString(ctx, "hits");
+        RedisModule_ReplyWithLongLong(ctx, ResultCache->hits);
+        RedisModule_ReplyWithSimpleString(ctx, "misses");
+        RedisModule_ReplyWithLongLong(ctx, ResultCache->misses);
+        RedisModule_ReplyWithSimpleString(ctx, "evictions");
+        RedisModule_ReplyWithLongLong(ctx, ResultCache->evictions);
+        RedisModule_ReplyWithSimpleString(ctx, "generation");
+        RedisModule_ReplyWithLongLong(ctx, NextGeneration - 1);
+        return REDISMODULE_OK;
+    }
+    if (!strcasecmp(sub, "reset") && argc == 2) {
+        wt_cache_clear(ResultCache);
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+    if (!strcasecmp(sub, "size") && argc == 3) {
+        long long capacity;
+        if (RedisModule_StringToLongLong(argv[2], &capacity) != REDISMODULE_OK || capacity < 0)
+            return RedisModule_ReplyWithError(ctx, "ERR invalid cache size");
+        wt_cache_resize(ResultCache, capacity);
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+    return RedisModule_ReplyWithError(ctx, "ERR syntax error");
 }
 
+// Module arguments: [CACHE BYTES]
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     if (RedisModule_Init(ctx, "wvltr", 1, REDISMODULE_APIVER_1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
+#ifdef WT_STATS
+    _stats_install();
+#endif
+
+    int i;
+    long long cache_size = 0, threads;
+    wt_kernels_init(NULL);
+    for(i = 0; i < argc; i += 2) {
+        const char *opt = RedisModule_StringPtrLen(argv[i], NULL);
+        if (i + 1 < argc && !strcasecmp(opt, "cache") &&
+                RedisModule_StringToLongLong(argv[i+1], &cache_size) == REDISMODULE_OK && cache_size >= 0)
+            continue;
+        if (i + 1 < argc && !strcasecmp(opt, "kernels") &&
+                wt_kernels_init(RedisModule_StringPtrLen(argv[i+1], NULL)))
+            continue;
+        if (i + 1 < argc && !strcasecmp(opt, "threads") &&
+                RedisModule_StringToLongLong(argv[i+1], &threads) == REDISMODULE_OK && threads >= 1) {
+            wt_set_build_threads(threads < INT_MAX ? threads : INT_MAX);
+            continue;
+        }
+        return REDISMODULE_ERR;
+    }
+    ResultCache = wt_cache_new(cache_size);
 
-    WaveletTreeType = RedisModule_CreateDataType(ctx, "waveletre", 0, WaveletTreeType_Load,
+    WaveletTreeType = RedisModule_CreateDataType(ctx, "waveletre", WAVELET_TREE_ENCVER, WaveletTreeType_Load,
         WaveletTreeType_Save, WaveletTreeType_Rewrite, WaveletTreeType_Digest, WaveletTreeType_Free);
     if (WaveletTreeType == NULL)
         return REDISMODULE_ERR;
 
+    PointGridType = RedisModule_CreateDataType(ctx, "wvltrgrid", 0, PointGridType_Load,
+        PointGridType_Save, PointGridType_Rewrite, PointGridType_Digest, PointGridType_Free);
+    if (PointGridType == NULL)
+        return REDISMODULE_ERR;
+
+    FMIndexType = RedisModule_CreateDataType(ctx, "wvltrfmix", 0, FMIndexType_Load,
+        FMIndexType_Save, FMIndexType_Rewrite, FMIndexType_Digest, FMIndexType_Free);
+    if (FMIndexType == NULL)
+        return REDISMODULE_ERR;
+
     if (RedisModule_CreateCommand(ctx, "wvltr.lbuild",
             WaveletTreeBuildFromList_RedisCommand, "write deny-oom", 1, 2, 1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
@@ -648,6 +2785,10 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
             WaveletTreeAccess_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx, "wvltr.getrange",
+            WaveletTreeGetRange_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
     if (RedisModule_CreateCommand(ctx, "wvltr.rank",
             WaveletTreeRank_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
@@ -656,14 +2797,46 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
             WaveletTreeSelect_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx, "wvltr.nextpos",
+            WaveletTreeNextPos_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.prevpos",
+            WaveletTreePrevPos_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.positions",
+            WaveletTreePositions_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
     if (RedisModule_CreateCommand(ctx, "wvltr.quantile",
             WaveletTreeQuantile_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx, "wvltr.quantiles",
+            WaveletTreeQuantiles_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
     if (RedisModule_CreateCommand(ctx, "wvltr.rangefreq",
             WaveletTreeRangeFreq_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx, "wvltr.rangehist",
+            WaveletTreeRangeHist_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.distinct",
+            WaveletTreeDistinct_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.rangesum",
+            WaveletTreeRangeSum_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.kthsum",
+            WaveletTreeKthSum_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
     if (RedisModule_CreateCommand(ctx, "wvltr.rangelist",
             WaveletTreeRangeList_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
@@ -680,6 +2853,14 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
             WaveletTreeTopK_RedisCommand, "readonly deny-oom", 1, 1, 1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx, "wvltr.slidingquantile",
+            WaveletTreeSlidingQuantile_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.slidingtopk",
+            WaveletTreeSlidingTopK_RedisCommand, "readonly deny-oom", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
     if (RedisModule_CreateCommand(ctx, "wvltr.rangemink",
             WaveletTreeRangeMinK_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
@@ -688,6 +2869,74 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
             WaveletTreeRangeMaxK_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx, "wvltr.mquantile",
+            WaveletTreeMultiQuantile_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.mrangefreq",
+            WaveletTreeMultiRangeFreq_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.mtopk",
+            WaveletTreeMultiTopK_RedisCommand, "readonly deny-oom", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.intersect",
+            WaveletTreeIntersect_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.rangeheavy",
+            WaveletTreeRangeHeavy_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.info",
+            WaveletTreeInfo_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.pointbuild",
+            PointGridBuild_RedisCommand, "write deny-oom", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.pointset",
+            PointGridSet_RedisCommand, "write deny-oom", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.pointcount",
+            PointGridCount_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.pointrange",
+            PointGridRange_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.pointnearest",
+            PointGridNearest_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.fmbuild",
+            FMIndexBuild_RedisCommand, "write deny-oom", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.fmcount",
+            FMIndexCount_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.fmlocate",
+            FMIndexLocate_RedisCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.cache",
+            WaveletTreeCache_RedisCommand, "admin", 0, 0, 0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.bench",
+            WaveletTreeBench_RedisCommand, "admin", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "wvltr.stats",
+            WaveletTreeStats_RedisCommand, "readonly", 0, 0, 0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
     return REDISMODULE_OK;
 }
 
@@ -697,11 +2946,25 @@ void value_count_callback(void *user_data, int32_t value, int count) {
     printf("  value = %d, count = %d\n", value, count);
 }
 
+void point_callback(void *user_data, int32_t x, int32_t y) {
+    printf("  x = %d, y = %d\n", x, y);
+}
+
+void value_counts_callback(void *user_data, int32_t value, int count1, int count2) {
+    printf("  value = %d, counts = %d %d\n", value, count1, count2);
+}
+
+void window_callback(void *user_data, size_t window) {
+    printf("  window %zu\n", window);
+}
+
 #include <stdio.h>
 int main(void) {
     int32_t array[] = {
         3, 3, 9, 1, 2, 1, 7, 6, 4, 8, 9, 4, 3, 7, 5, 9, 2, 7, 3, 5, 1, 3
     };
+    wt_kernels_init(NULL);
+    printf("kernels = %s\n", wt_kernels_active->name);
     wt_tree *t = wt_new();
     wt_build(t, array, 22);
 
@@ -712,20 +2975,154 @@ int main(void) {
     }
     printf("\n");
 
+    int32_t values[22];
+    wt_get_range(t, 0, 22, values);
+    for(i = 0; i < 22; ++i)
+        printf("%d ", values[i]);
+    printf("\n");
+
     printf("rank_3(S, 14) = %d\n", wt_rank(t, 3, 14));
     if(wt_quantile(t, 6, 16, 6, &res))
         printf("quantile_6(S, 6, 16) = %d\n", res);
+    size_t ks[] = {1, 5, 6, 10};
+    int32_t qs[4];
+    if(wt_quantiles(t, 6, 16, ks, 4, qs))
+        printf("quantiles_{1,5,6,10}(S, 6, 16) = %d %d %d %d\n", qs[0], qs[1], qs[2], qs[3]);
     printf("select(S, 3, 4) = %d\n", wt_select(t, 3, 4));
+    printf("next_pos(S, 3, 2) = %d\n", wt_next_pos(t, 3, 2));
+    printf("prev_pos(S, 3, 12) = %d\n", wt_prev_pos(t, 3, 12));
+    size_t ps[4], npos = wt_positions(t, 3, 1, 22, 1, 4, ps, NULL);
+    printf("positions(S, 3, 1, 22, 1, 4) =");
+    for(i = 0; i < npos; ++i)
+        printf(" %zu", ps[i]);
+    printf("\n");
     printf("range_freq(S, 0, 8, 3, 6) = %d\n", wt_range_freq(t, 0, 8, 3, 6));
+    int32_t qlo, qhi;
+    if(wt_quantile_approx(t, 6, 16, 6, 30, &qlo, &qhi))
+        printf("quantile_approx_6(S, 6, 16, 30) = [%d, %d]\n", qlo, qhi);
+    int flo, fhi;
+    wt_range_freq_approx(t, 0, 8, 3, 6, 30, &flo, &fhi);
+    printf("range_freq_approx(S, 0, 8, 3, 6, 30) = [%d, %d]\n", flo, fhi);
+    int32_t edges[] = {0, 3, 6, 10};
+    int hist[3];
+    if(wt_range_hist(t, 0, 8, edges, 4, hist))
+        printf("range_hist(S, 0, 8, {0, 3, 6, 10}) = %d %d %d\n", hist[0], hist[1], hist[2]);
+    wt_tree *d = wt_new();
+    d->flags = WT_FLAG_DISTINCT | WT_FLAG_SUMS;
+    wt_build(d, values, 22);
+    printf("range_distinct(S, 5, 17) = %d\n", wt_range_distinct(d, 5, 17));
+    printf("range_sum(S, 0, 8, 3, 7) = %lld\n", (long long)wt_range_sum(d, 0, 8, 3, 7));
+    printf("kth_sum(S, 6, 16, 3) = %lld\n", (long long)wt_kth_sum(d, 6, 16, 3));
+    wt_free(d);
     printf("range_list(5, 17, 2, 6) = %d\n", wt_range_list(t, 5, 17, 2, 6, value_count_callback, NULL));
     printf("prev_value(15, 19, 3, 7) = %d\n", wt_prev_value(t, 15, 19, 3, 7));
     printf("next_value(15, 19, 3, 7) = %d\n", wt_next_value(t, 15, 19, 3, 7));
     printf("topk(0, 22, 5) = %d\n", wt_topk(t, 0, 22, 5, value_count_callback, NULL));
+    wt_budget budget;
+    wt_budget_init(&budget, 40, 0);
+    printf("topk_budget(0, 22, 5, 40) = %d\n", wt_topk_budget(t, 0, 22, 5, &budget, value_count_callback, NULL));
+    printf("  exhausted = %d\n", budget.exhausted);
+    int32_t sq[8];
+    size_t w, nw = wt_sliding_quantile(t, 0, 22, 8, 2, 4, sq);
+    printf("sliding_quantile(0, 22, 8, 2, 4) =");
+    for(w = 0; w < nw; ++w)
+        printf(" %d", sq[w]);
+    printf("\n");
+    printf("sliding_topk(0, 22, 10, 6, 2) = %zu\n", wt_sliding_topk(t, 0, 22, 10, 6, 2, window_callback, value_count_callback, NULL));
     printf("range_mink(10, 19, 5) = %d\n", wt_range_mink(t, 10, 19, 5, value_count_callback, NULL));
     printf("range_maxk(10, 19, 5) = %d\n", wt_range_maxk(t, 10, 19, 5, value_count_callback, NULL));
 
+    wt_interval ivs[] = {{0, 4}, {12, 18}, {2, 6}};
+    if(wt_quantile_multi(t, ivs, 3, 5, &res))
+        printf("quantile_multi_5({[0, 6), [12, 18)}) = %d\n", res);
+    printf("range_freq_multi({[0, 6), [12, 18)}, 3, 6) = %d\n", wt_range_freq_multi(t, ivs, 3, 3, 6));
+    printf("topk_multi({[0, 6), [12, 18)}, 3) = %d\n", wt_topk_multi(t, ivs, 3, 3, value_count_callback, NULL));
+    printf("range_intersect([0, 8), [12, 22)) = %d\n", wt_range_intersect(t, 0, 8, 12, 22, value_counts_callback, NULL));
+    printf("range_heavy(0, 22, 3) = %d\n", wt_range_heavy(t, 0, 22, 3, value_count_callback, NULL));
+
+    wt_usage usage;
+    wt_memory_report(t, &usage);
+    printf("memory_report: distinct = %zu, height = %zu, nodes = %zu, bytes = %zu (memory_usage = %zu)\n",
+        usage.distinct, usage.height, usage.nodes, usage.bytes, wt_memory_usage(t));
+
+    uint64_t latencies[100];
+    int op;
+    for(op = 0; BenchOps[op]; ++op) {
+        _bench_run(t, op, 100, 1, latencies);
+        qsort(latencies, 100, sizeof(uint64_t), _bench_compare);
+        printf("bench %s p50 = %llu ns\n", BenchOps[op], (unsigned long long)latencies[50]);
+    }
+
     wt_free(t);
 
+    // parallel build
+    size_t big = 1 << 18;
+    int32_t *serial = malloc(big * sizeof(int32_t)), *parallel = malloc(big * sizeof(int32_t));
+    for(i = 0; i < (int)big; ++i)
+        serial[i] = parallel[i] = (i * 2654435761U) % 1000;
+    t = wt_new_bounded(0, 999);
+    wt_build(t, serial, big);
+    wt_tree *pt = wt_new_bounded(0, 999);
+    wt_set_build_threads(4);
+    wt_build(pt, parallel, big);
+    wt_set_build_threads(1);
+    wt_get_range(t, 0, big, serial);
+    wt_get_range(pt, 0, big, parallel);
+    printf("parallel build: same values = %d, memory_usage = %zu (serial %zu)\n",
+        !memcmp(serial, parallel, big * sizeof(int32_t)), wt_memory_usage(pt), wt_memory_usage(t));
+    free(serial);
+    free(parallel);
+
+    // batch queries
+    wt_query batch[256];
+    for(i = 0; i < 256; ++i) {
+        batch[i].op = i % 2 ? WT_QUERY_RANK : WT_QUERY_QUANTILE;
+        batch[i].i = i * 1000;
+        batch[i].j = i * 1000 + 500;
+        batch[i].x = i % 2 ? i : 250;
+    }
+    wt_query_batch(pt, batch, 256, 4);
+    printf("query_batch: quantile_250([0, 500)) = %lld, rank_255(S, 255000) = %lld\n",
+        (long long)batch[0].result, (long long)batch[255].result);
+    wt_free(pt);
+    wt_free(t);
+
+    // point grid
+    int32_t px[] = {5, 1, 3, 8, 3, 6, 2};
+    int32_t py[] = {2, 7, 4, 1, 9, 5, 3};
+    wt_grid *g = wt_grid_new();
+    wt_grid_build(g, px, py, 7);
+    printf("grid_count([2, 7) x [3, 8)) = %d\n", wt_grid_count(g, 2, 7, 3, 8));
+    printf("grid_report([2, 7) x [3, 8), 1, 5) = %zu\n", wt_grid_report(g, 2, 7, 3, 8, 1, 5, point_callback, NULL));
+    printf("grid_nearest([1, 9), 6, 3) = %zu\n", wt_grid_nearest(g, 1, 9, 6, 3, point_callback, NULL));
+    wt_grid_free(g);
+
+    // FM-index
+    const char *text = "abracadabra";
+    size_t occ[4];
+    fm_index *fm = fm_new();
+    fm_build(fm, (const unsigned char *)text, 11);
+    printf("fm_count(abra) = %zu\n", fm_count(fm, (const unsigned char *)"abra", 4));
+    size_t nocc = fm_locate(fm, (const unsigned char *)"a", 1, 4, occ);
+    printf("fm_locate(a) =");
+    for(w = 0; w < nocc; ++w)
+        printf(" %zu", occ[w]);
+    printf("\n");
+    fm_free(fm);
+
+    // result cache
+    wt_cache *cache = wt_cache_new(2 * sizeof(wt_cache_entry) + 16);
+    size_t vlen;
+    wt_cache_put(cache, "a", 1, "1234", 4);
+    wt_cache_put(cache, "b", 1, "5678", 4);
+    wt_cache_get(cache, "a", 1, &vlen);
+    wt_cache_put(cache, "c", 1, "9abc", 4);
+    printf("cache a b c = %d %d %d\n", wt_cache_get(cache, "a", 1, &vlen) != NULL,
+        wt_cache_get(cache, "b", 1, &vlen) != NULL, wt_cache_get(cache, "c", 1, &vlen) != NULL);
+    printf("cache entries = %zu, hits = %llu, misses = %llu, evictions = %llu\n",
+        cache->len, cache->hits, cache->misses, cache->evictions);
+    wt_cache_free(cache);
+
     // heap
     heap *heap = heap_new();
     int score;
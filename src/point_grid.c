@@ -0,0 +1,165 @@
+#include <stdlib.h>
+
+#include "point_grid.h"
+
+typedef struct grid_point {
+    int32_t x, y;
+} grid_point;
+
+static int _grid_point_compare(const void *a, const void *b) {
+    const grid_point *p = a, *q = b;
+    if (p->x != q->x)
+        return p->x < q->x ? -1 : 1;
+    return p->y < q->y ? -1 : p->y > q->y;
+}
+
+static int _int32_compare(const void *a, const void *b) {
+    int32_t x = *(const int32_t*)a, y = *(const int32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+wt_grid *wt_grid_new(void) {
+    return calloc(1, sizeof(wt_grid));
+}
+
+// Number of distinct y coordinates less than y, i.e. the rank y would have
+static size_t _wt_grid_y_rank(const wt_grid *grid, int64_t y) {
+    size_t l = 0, r = grid->ny;
+    while (l < r) {
+        size_t m = (l + r) >> 1;
+        if (grid->yvals[m] < y)
+            l = m + 1;
+        else
+            r = m;
+    }
+    return l;
+}
+
+void wt_grid_build(wt_grid *grid, const int32_t *xs, const int32_t *ys, size_t len) {
+    size_t p;
+    grid_point *points = malloc((len + 1) * sizeof(grid_point));
+    for(p = 0; p < len; ++p) {
+        points[p].x = xs[p];
+        points[p].y = ys[p];
+    }
+    qsort(points, len, sizeof(grid_point), _grid_point_compare);
+
+    int32_t *data = malloc((len + 1) * sizeof(int32_t));
+    grid->xs = malloc((len + 1) * sizeof(int32_t));
+    grid->yvals = malloc((len + 1) * sizeof(int32_t));
+    for(p = 0; p < len; ++p) {
+        grid->xs[p] = points[p].x;
+        data[p] = grid->yvals[p] = points[p].y;
+    }
+    free(points);
+
+    qsort(grid->yvals, len, sizeof(int32_t), _int32_compare);
+    for(p = 0, grid->ny = 0; p < len; ++p) {
+        if (!grid->ny || grid->yvals[grid->ny - 1] != grid->yvals[p])
+            grid->yvals[grid->ny++] = grid->yvals[p];
+    }
+    for(p = 0; p < len; ++p)
+        data[p] = _wt_grid_y_rank(grid, data[p]);
+
+    grid->len = len;
+    grid->ys = wt_new_bounded(0, grid->ny ? grid->ny - 1 : 0);
+    wt_build(grid->ys, data, len);
+    free(data);
+}
+
+void wt_grid_free(wt_grid *grid) {
+    if (grid->ys)
+        wt_free(grid->ys);
+    free(grid->yvals);
+    free(grid->xs);
+    free(grid);
+}
+
+void wt_grid_get_ys(const wt_grid *grid, int32_t *out) {
+    size_t p;
+    wt_get_range(grid->ys, 0, grid->len, out);
+    for(p = 0; p < grid->len; ++p)
+        out[p] = grid->yvals[out[p]];
+}
+
+// Index of the first point whose x coordinate is not less than x
+static size_t _wt_grid_lower_bound(const wt_grid *grid, int64_t x) {
+    size_t l = 0, r = grid->len;
+    while (l < r) {
+        size_t m = (l + r) >> 1;
+        if (grid->xs[m] < x)
+            l = m + 1;
+        else
+            r = m;
+    }
+    return l;
+}
+
+int wt_grid_count(const wt_grid *grid, int64_t x1, int64_t x2, int64_t y1, int64_t y2) {
+    if (x2 <= x1 || y2 <= y1) return 0;
+
+    size_t i = _wt_grid_lower_bound(grid, x1), j = _wt_grid_lower_bound(grid, x2);
+    size_t r1 = _wt_grid_y_rank(grid, y1), r2 = _wt_grid_y_rank(grid, y2);
+    return wt_range_less(grid->ys, i, j, r2) - wt_range_less(grid->ys, i, j, r1);
+}
+
+// Emits the point having the r-th (0-origin) smallest y coordinate within
+// [i, j), where points sharing y are ordered by x.
+static void _wt_grid_point(const wt_grid *grid, size_t i, size_t j, size_t r,
+    void (*callback)(void*, int32_t, int32_t), void *user_data) {
+    int32_t y;
+    wt_quantile(grid->ys, i, j, r + 1, &y);
+    size_t t = r - wt_range_less(grid->ys, i, j, y);
+    int pos = wt_select(grid->ys, y, wt_rank(grid->ys, y, i) + t + 1);
+    callback(user_data, grid->xs[pos], grid->yvals[y]);
+}
+
+size_t wt_grid_report(const wt_grid *grid, int64_t x1, int64_t x2, int64_t y1, int64_t y2, size_t offset, size_t count,
+    void (*callback)(void*, int32_t, int32_t), void *user_data) {
+    if (x2 <= x1 || y2 <= y1) return 0;
+
+    size_t i = _wt_grid_lower_bound(grid, x1), j = _wt_grid_lower_bound(grid, x2);
+    size_t r1 = _wt_grid_y_rank(grid, y1), r2 = _wt_grid_y_rank(grid, y2);
+    size_t base = wt_range_less(grid->ys, i, j, r1), total = wt_range_less(grid->ys, i, j, r2) - base;
+
+    size_t r;
+    for(r = offset; r < total && r < offset + count; ++r)
+        _wt_grid_point(grid, i, j, base + r, callback, user_data);
+    return r < offset ? 0 : r - offset;
+}
+
+size_t wt_grid_nearest(const wt_grid *grid, int64_t x1, int64_t x2, int64_t y, size_t k,
+    void (*callback)(void*, int32_t, int32_t), void *user_data) {
+    if (x2 <= x1) return 0;
+
+    size_t i = _wt_grid_lower_bound(grid, x1), j = _wt_grid_lower_bound(grid, x2);
+    if (j <= i) return 0;
+    // Clamping keeps the distances below from overflowing and shifts them
+    // all alike when every point lies on one side of y
+    if (y < INT32_MIN) y = INT32_MIN;
+    if (INT32_MAX < y) y = INT32_MAX;
+
+    // Points ranked below `below` lie under y and points ranked from `above`
+    // lie on or over y; the closer of both frontiers is emitted each step.
+    size_t below = wt_range_less(grid->ys, i, j, _wt_grid_y_rank(grid, y)), above = below, count = 0;
+    int32_t vb, va;
+    while (count < k && (0 < below || above < j - i)) {
+        int take_above;
+        if (below == 0)
+            take_above = 1;
+        else if (j - i <= above)
+            take_above = 0;
+        else {
+            wt_quantile(grid->ys, i, j, below, &vb);
+            wt_quantile(grid->ys, i, j, above + 1, &va);
+            take_above = grid->yvals[va] - y <= y - grid->yvals[vb];
+        }
+
+        if (take_above)
+            _wt_grid_point(grid, i, j, above++, callback, user_data);
+        else
+            _wt_grid_point(grid, i, j, --below, callback, user_data);
+        ++count;
+    }
+    return count;
+}
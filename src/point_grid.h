@@ -0,0 +1,37 @@
+#ifndef __POINT_GRID_H__
+#define __POINT_GRID_H__
+
+#include "common.h"
+#include "wavelet_tree.h"
+
+/*
+ * Point Grid
+ *
+ * Points are sorted by x and the ranks of their y coordinates among the
+ * distinct ones are stored in a wavelet tree, so a rectangle [x1, x2) x
+ * [y1, y2) maps to the index range of the x coordinates and the rank range of
+ * the y coordinates, and the tree is only as tall as log2 of the distinct ys.
+ * Bounds are 64-bit so that exclusive ones past the 32-bit range still work.
+ */
+
+typedef struct wt_grid {
+    size_t len;
+    int32_t *xs;
+    // sorted distinct y coordinates, indexed by the values of the tree
+    size_t ny;
+    int32_t *yvals;
+    wt_tree *ys;
+} wt_grid;
+
+wt_grid *wt_grid_new(void);
+void wt_grid_build(wt_grid *grid, const int32_t *xs, const int32_t *ys, size_t len);
+void wt_grid_free(wt_grid *grid);
+// Stores the y coordinate of each point in x order into out
+void wt_grid_get_ys(const wt_grid *grid, int32_t *out);
+int wt_grid_count(const wt_grid *grid, int64_t x1, int64_t x2, int64_t y1, int64_t y2);
+size_t wt_grid_report(const wt_grid *grid, int64_t x1, int64_t x2, int64_t y1, int64_t y2, size_t offset, size_t count,
+    void (*callback)(void*, int32_t, int32_t), void *user_data);
+size_t wt_grid_nearest(const wt_grid *grid, int64_t x1, int64_t x2, int64_t y, size_t k,
+    void (*callback)(void*, int32_t, int32_t), void *user_data);
+
+#endif
@@ -0,0 +1,35 @@
+#include <string.h>
+
+#include "stats.h"
+
+wt_stats wt_counters;
+
+void wt_stats_reset(void) {
+    memset(&wt_counters, 0, sizeof(wt_counters));
+}
+
+void wt_histogram_add(wt_histogram *hist, uint64_t ns) {
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (WT_HISTOGRAM_BUCKETS <= b) b = WT_HISTOGRAM_BUCKETS - 1;
+    ++hist->buckets[b];
+    ++hist->count;
+    hist->total += ns;
+}
+
+// Exclusive upper bound of the latencies counted in bucket b
+uint64_t wt_histogram_bucket_upper(int b) {
+    return 1ULL << b;
+}
+
+// Upper bound of the bucket holding the p-th percentile, 0 when empty
+uint64_t wt_histogram_percentile(const wt_histogram *hist, double p) {
+    int b;
+    unsigned long long seen = 0, rank = hist->count * p / 100;
+    if (!hist->count) return 0;
+    if (hist->count <= rank) rank = hist->count - 1;
+    for(b = 0; b < WT_HISTOGRAM_BUCKETS; ++b) {
+        seen += hist->buckets[b];
+        if (rank < seen) break;
+    }
+    return wt_histogram_bucket_upper(b);
+}
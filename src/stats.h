@@ -0,0 +1,38 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "common.h"
+
+// Counters of the work done by queries. They are only updated when built with
+// -DWT_STATS (make STATS=1), otherwise the macros below compile to nothing.
+typedef struct wt_stats {
+    unsigned long long nodes_visited;
+    unsigned long long fid_rank_calls;
+    unsigned long long fid_select_calls;
+    unsigned long long heap_pushes;
+    unsigned long long reply_elements;
+} wt_stats;
+
+extern wt_stats wt_counters;
+
+#ifdef WT_STATS
+#define WT_STAT_ADD(counter, n) (wt_counters.counter += (n))
+#else
+#define WT_STAT_ADD(counter, n) ((void)0)
+#endif
+#define WT_STAT_INC(counter) WT_STAT_ADD(counter, 1)
+
+// Latencies in ns with power-of-two buckets: bucket b counts [2^(b-1), 2^b)
+#define WT_HISTOGRAM_BUCKETS 40
+
+typedef struct wt_histogram {
+    unsigned long long count, total;
+    unsigned long long buckets[WT_HISTOGRAM_BUCKETS];
+} wt_histogram;
+
+void wt_stats_reset(void);
+void wt_histogram_add(wt_histogram *hist, uint64_t ns);
+uint64_t wt_histogram_percentile(const wt_histogram *hist, double p);
+uint64_t wt_histogram_bucket_upper(int b);
+
+#endif
@@ -1,31 +1,36 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernels.h"
 #include "wavelet_tree.h"
 
 /*
  * Fully Indexable Dictionary
  */
 
-fid *fid_new(uint32_t *bytes, size_t n) {
+fid *fid_new(uint64_t *words, size_t n) {
     fid *fid = calloc(1, sizeof(*fid));
-    fid->bs = bytes;
+    fid->bs = words;
     fid->n = n;
-    fid->rs = calloc(FID_I2SBI(fid, fid->n) + 1, sizeof(uint32_t));
-    fid->rb = calloc(FID_I2BI(fid, fid->n) + 1, sizeof(uint16_t));
-
-    int i, srank = 0, brank = 0;
-    uint32_t *rs = fid->rs;
-    uint16_t *rb = fid->rb;
-    *(rs++) = 0;
-    *(rb++) = 0;
-    for(i = 1; i <= FID_I2BI(fid, fid->n); ++i) {
-        int pc = __builtin_popcount(*(bytes++));
-        srank += pc;
-        brank += pc;
-
-        if (!(i & FID_MASK_BSEP(fid))) {
-            brank = 0;
-            *(rs++) = srank;
+    fid->rd = malloc(FID_NSUPERBLOCKS(fid, n) * sizeof(uint64_t));
+
+    size_t sb, k, w, end, nwords = FID_NWORDS(fid, n);
+    uint64_t rank = 0, block_ranks, count;
+    for(sb = 0, w = 0; sb < FID_NSUPERBLOCKS(fid, n); ++sb) {
+        block_ranks = count = 0;
+        for(k = 0; k <= FID_MASK_BSEP(fid); ++k) {
+            if (k) block_ranks |= count << (10 * (k - 1));
+            end = FID_BI2WI(fid, FID_SBI2BI(fid, sb) + k + 1);
+            if (nwords < end) end = nwords;
+            if (w < end) {
+                count += wt_kernels_active->popcount(words + w, end - w);
+                w = end;
+            }
         }
-        *(rb++) = brank;
+        fid->rd[sb] = (block_ranks << 32) | rank;
+        rank += count;
     }
 
     return fid;
@@ -33,71 +38,79 @@ fid *fid_new(uint32_t *bytes, size_t n) {
 
 void fid_free(fid *fid) {
     free(fid->bs);
-    free(fid->rs);
-    free(fid->rb);
+    free(fid->rd);
     free(fid);
 }
 
-static inline int fid_rank(fid *fid, int b, size_t i) {
-    if (fid->n < i) i = fid->n;
-    int res = fid->rs[FID_I2SBI(fid, i)] + fid->rb[FID_I2BI(fid, i)] + __builtin_popcount(FID_CHOP_BLOCK_I(fid, fid->bs[FID_I2BI(fid, i)], i));
-    return b ? res : i - res;
+// Position of the i-th (1-based) set bit of x
+static inline int _fid_select_word(uint64_t x, int i) {
+    int c, res = 0;
+    while ((c = __builtin_popcount(x & 0xFF)) < i) {
+        i -= c;
+        x >>= 8;
+        res += 8;
+    }
+    for(; i > 1; --i)
+        x &= x - 1;
+    return res + __builtin_ctzll(x);
 }
 
 int fid_select(fid *fid, int b, int i) {
-    int l, r;
-    l = FID_I2SBI(fid, i);
-    r = FID_I2SBI(fid, fid->n) + 1;
+    WT_STAT_INC(fid_select_calls);
+    // the superblock holding the i-th b, found on the directory entries
+    size_t l = FID_I2SBI(fid, (size_t)i - 1), r = FID_NSUPERBLOCKS(fid, fid->n), m;
+    if (r < l + 1) l = r - 1;
     while (l + 1 < r) {
-        int m = MID(l, r);
-        int rank = fid->rs[m];
+        m = (l + r) >> 1;
+        size_t rank = FID_RD_RANK(fid->rd[m]);
         if (!b) rank = FID_SBI2I(fid, m) - rank;
         if (i <= rank)
             r = m;
         else
             l = m;
     }
-    if (b)
-        i -= fid->rs[l];
-    else
-        i -= FID_SBI2I(fid, l) - fid->rs[l];
-    r = FID_SBI2BI(fid, l + 1);
-    int offset = l = FID_SBI2BI(fid, l);
-    if (FID_I2BI(fid, fid->n) + 1 < r)
-        r = FID_I2BI(fid, fid->n) + 1;
-    while (l + 1 < r) {
-        int m = MID(l, r);
-        int rank = fid->rb[m];
-        if (!b) rank = FID_BI2I(fid, m - offset) - rank;
-        if (i <= rank)
-            r = m;
-        else
-            l = m;
+    uint64_t e = fid->rd[l];
+    i -= b ? FID_RD_RANK(e) : FID_SBI2I(fid, l) - FID_RD_RANK(e);
+
+    // then the block within it
+    size_t k, rank;
+    for(k = FID_MASK_BSEP(fid); k > 0; --k) {
+        rank = FID_RD_BLOCK_RANK(e, k);
+        if (!b) rank = FID_BI2I(fid, k) - rank;
+        if (rank < i) break;
     }
-    if (b)
-        i -= fid->rb[l];
-    else
-        i -= FID_BI2I(fid, l - offset) - fid->rb[l];
-    unsigned int byte = fid->bs[l], res = FID_BI2I(fid, l);
-    int mask = 0xFFFF0000;
-
-    l = 0; r = 32;
-
-    if (!b) byte = ~byte;
-    while(l + 1 < r) {
-        int m = MID(l, r);
-        int rank = __builtin_popcount(byte & mask);
-        if (i <= rank) {
-            mask <<= (r - m) >> 1;
-            r = m;
-        }
-        else {
-            mask >>= (m - l) >> 1;
-            l = m;
-        }
+    rank = FID_RD_BLOCK_RANK(e, k);
+    i -= b ? rank : FID_BI2I(fid, k) - rank;
+
+    // and the word
+    size_t w = FID_BI2WI(fid, FID_SBI2BI(fid, l) + k), nwords = FID_NWORDS(fid, fid->n);
+    uint64_t word;
+    int c;
+    for(; w < nwords; ++w) {
+        word = b ? fid->bs[w] : ~fid->bs[w];
+        c = __builtin_popcountll(word);
+        if (i <= c)
+            return FID_WI2I(fid, w) + _fid_select_word(word, i);
+        i -= c;
     }
+    return fid->n;
+}
 
-    return res + l;
+/*
+ * Work budget
+ */
+
+uint64_t wt_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void wt_budget_init(wt_budget *budget, size_t max_work, uint64_t timeout_ms) {
+    budget->max_work = max_work;
+    budget->deadline = timeout_ms ? wt_clock_ns() + timeout_ms * 1000000ULL : 0;
+    budget->work = 0;
+    budget->exhausted = 0;
 }
 
 /*
@@ -111,37 +124,37 @@ wt_node *wt_node_new(wt_node *parent) {
 }
 
 wt_tree *wt_new(void) {
+    return wt_new_bounded(MIN_ALPHABET, MAX_ALPHABET);
+}
+
+wt_tree *wt_new_bounded(int32_t lower, int32_t upper) {
     wt_tree *tree;
     tree = calloc(1, sizeof(*tree));
     tree->root = wt_node_new(NULL);
+    tree->lower = lower;
+    tree->upper = upper;
     return tree;
 }
 
-void _wt_build(wt_node *cur, int32_t *data, int n, int32_t lower, int32_t upper) {
+void _wt_build(wt_node *cur, int32_t *data, int n, int32_t lower, int32_t upper, int flags) {
     cur->n = n;
 
     if(lower == upper) return;
 
+    int i;
+    if (flags & WT_FLAG_SUMS) {
+        cur->sums = malloc((n + 1) * sizeof(int64_t));
+        cur->sums[0] = 0;
+        for(i = 0; i < n; ++i)
+            cur->sums[i+1] = cur->sums[i] + data[i];
+    }
+
     int32_t mid = MID(lower, upper);
-    uint32_t *bytes = calloc(FID_I2BI(fid, n) + ((n & FID_MASK_BI(fid)) ? 1 : 0), sizeof(uint32_t));
+    uint64_t *words = calloc(FID_NWORDS(fid, n), sizeof(uint64_t));
 
-    int i, nl = 0;
-    uint32_t *bhead = bytes;
-    for(i = 0; i < n; ) {
-        *bhead <<= 1;
-        if (data[i] <= mid) {
-            nl++;
-        }
-        else
-            *bhead |= 1;
-        ++i;
-        if (!(i & FID_MASK_BI(fid)))
-            ++bhead;
-    }
-    if (i & FID_MASK_BI(fid))
-        *bhead <<= FID_NBIT_B(fid) - (i & FID_MASK_BI(fid));
+    int nl = wt_kernels_active->pack(data, n, mid, words);
 
-    cur->fid = fid_new(bytes, n);
+    cur->fid = fid_new(words, n);
 
     int j, carry, tmp;
     for(i = 0; i < n; ++i) {
@@ -170,12 +183,12 @@ void _wt_build(wt_node *cur, int32_t *data, int n, int32_t lower, int32_t upper)
 
     if (nl) {
         cur->left = wt_node_new(cur);
-        _wt_build(cur->left, data, nl, lower, mid);
+        _wt_build(cur->left, data, nl, lower, mid, flags);
     }
 
     if (n - nl) {
         cur->right = wt_node_new(cur);
-        _wt_build(cur->right, data + nl, n - nl, mid+1, upper);
+        _wt_build(cur->right, data + nl, n - nl, mid+1, upper, flags);
     }
 
     if (DESTRUCTIVE_BUILD) return;
@@ -209,28 +222,290 @@ void _wt_build(wt_node *cur, int32_t *data, int n, int32_t lower, int32_t upper)
         data[fid_select(cur->fid, 0, i+1)] += mid - lower + 1;
 }
 
+/*
+ * Parallel build
+ */
+
+// Nodes with fewer elements, and those left with a single thread, are built
+// in place by _wt_build
+#define WT_PARALLEL_MIN (1 << 16)
+#define WT_MAX_BUILD_THREADS 64
+
+static int _wt_build_threads = 1;
+
+void wt_set_build_threads(int threads) {
+    if (threads < 1) threads = 1;
+    if (WT_MAX_BUILD_THREADS < threads) threads = WT_MAX_BUILD_THREADS;
+    _wt_build_threads = threads;
+}
+
+// A slice of a node, aligned to words so that chunks never share one
+typedef struct wt_build_chunk {
+    const int32_t *data;
+    int32_t *scratch;
+    uint64_t *words;
+    int32_t mid;
+    size_t lo, hi;
+    size_t nl;              // elements of [lo, hi) going left
+    size_t left, right;     // where they go in scratch
+} wt_build_chunk;
+
+static void *_wt_pack_chunk(void *arg) {
+    wt_build_chunk *c = arg;
+    c->nl = wt_kernels_active->pack(c->data + c->lo, c->hi - c->lo, c->mid, c->words + FID_I2WI(fid, c->lo));
+    return NULL;
+}
+
+// Stable partition of the chunk into scratch, as the in-place permutation of
+// _wt_build would order it
+static void *_wt_scatter_chunk(void *arg) {
+    wt_build_chunk *c = arg;
+    size_t p, l = c->left, r = c->right;
+    for(p = c->lo; p < c->hi; ++p) {
+        if (c->data[p] <= c->mid)
+            c->scratch[l++] = c->data[p];
+        else
+            c->scratch[r++] = c->data[p];
+    }
+    return NULL;
+}
+
+// Runs fn over every chunk, each but the first on a thread of its own. A
+// chunk whose thread cannot be created runs on the calling one.
+static void _wt_run_chunks(void *(*fn)(void*), wt_build_chunk *chunks, int m) {
+    pthread_t threads[WT_MAX_BUILD_THREADS];
+    int k, started[WT_MAX_BUILD_THREADS];
+    for(k = 1; k < m; ++k) {
+        started[k] = pthread_create(&threads[k], NULL, fn, chunks + k) == 0;
+        if (!started[k]) fn(chunks + k);
+    }
+    fn(chunks);
+    for(k = 1; k < m; ++k)
+        if (started[k]) pthread_join(threads[k], NULL);
+}
+
+typedef struct wt_build_task {
+    wt_node *cur;
+    int32_t *data, *scratch;
+    size_t n;
+    int32_t lower, upper;
+    int flags, threads;
+} wt_build_task;
+
+// Builds the subtree of a task with up to task->threads threads. The bit
+// plane is packed and the values partitioned into scratch by chunks in
+// parallel, then the threads are split between the children by their sizes
+// and the left child is built on a new thread. Children swap data and
+// scratch, so that nothing is copied back. The nodes come out identical to
+// those of _wt_build.
+static void *_wt_build_parallel(void *arg) {
+    wt_build_task *task = arg;
+    wt_node *cur = task->cur;
+    size_t n = task->n, p;
+    if (task->threads < 2 || n < WT_PARALLEL_MIN || task->lower == task->upper) {
+        _wt_build(cur, task->data, n, task->lower, task->upper, task->flags);
+        return NULL;
+    }
+
+    cur->n = n;
+    if (task->flags & WT_FLAG_SUMS) {
+        cur->sums = malloc((n + 1) * sizeof(int64_t));
+        cur->sums[0] = 0;
+        for(p = 0; p < n; ++p)
+            cur->sums[p+1] = cur->sums[p] + task->data[p];
+    }
+
+    int32_t mid = MID(task->lower, task->upper);
+    uint64_t *words = calloc(FID_NWORDS(fid, n), sizeof(uint64_t));
+
+    wt_build_chunk chunks[WT_MAX_BUILD_THREADS];
+    int k, m = task->threads;
+    if (n / WT_PARALLEL_MIN < m) m = n / WT_PARALLEL_MIN;
+    size_t size = FID_WI2I(fid, FID_I2WI(fid, n / m + FID_MASK_WI(fid)));
+    for(k = 0; k < m; ++k) {
+        chunks[k].data = task->data;
+        chunks[k].scratch = task->scratch;
+        chunks[k].words = words;
+        chunks[k].mid = mid;
+        chunks[k].lo = k * size < n ? k * size : n;
+        chunks[k].hi = (k + 1) * size < n && k + 1 < m ? (k + 1) * size : n;
+    }
+    _wt_run_chunks(_wt_pack_chunk, chunks, m);
+
+    size_t nl = 0;
+    for(k = 0; k < m; ++k)
+        nl += chunks[k].nl;
+    cur->fid = fid_new(words, n);
+
+    size_t left = 0, right = nl;
+    for(k = 0; k < m; ++k) {
+        chunks[k].left = left;
+        chunks[k].right = right;
+        left += chunks[k].nl;
+        right += chunks[k].hi - chunks[k].lo - chunks[k].nl;
+    }
+    _wt_run_chunks(_wt_scatter_chunk, chunks, m);
+
+    wt_build_task l = { NULL, task->scratch, task->data, nl, task->lower, mid, task->flags, task->threads };
+    wt_build_task r = { NULL, task->scratch + nl, task->data + nl, n - nl, mid + 1, task->upper, task->flags, task->threads };
+    if (nl && n - nl) {
+        l.threads = (task->threads * nl + n / 2) / n;
+        if (l.threads < 1) l.threads = 1;
+        if (task->threads - 1 < l.threads) l.threads = task->threads - 1;
+        r.threads = task->threads - l.threads;
+    }
+
+    if (nl) l.cur = cur->left = wt_node_new(cur);
+    if (n - nl) r.cur = cur->right = wt_node_new(cur);
+
+    pthread_t thread;
+    int started = 0;
+    if (l.cur && r.cur)
+        started = pthread_create(&thread, NULL, _wt_build_parallel, &l) == 0;
+    if (l.cur && !started)
+        _wt_build_parallel(&l);
+    if (r.cur)
+        _wt_build_parallel(&r);
+    if (started)
+        pthread_join(thread, NULL);
+    return NULL;
+}
+
+typedef struct value_pos {
+    int32_t value;
+    int32_t pos;
+} value_pos;
+
+static int _value_pos_compare(const void *a, const void *b) {
+    const value_pos *x = a, *y = b;
+    if (x->value != y->value)
+        return x->value < y->value ? -1 : 1;
+    return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+// Builds a tree over the position of the previous occurrence of each element
+// (-1 for first occurrences). An element is the first of its value within
+// [i, j) iff its previous occurrence is less than i.
+wt_tree *_wt_build_prev(const int32_t *data, size_t len) {
+    size_t p;
+    value_pos *vp = malloc((len + 1) * sizeof(value_pos));
+    int32_t *prev = malloc((len + 1) * sizeof(int32_t));
+
+    for(p = 0; p < len; ++p) {
+        vp[p].value = data[p];
+        vp[p].pos = p;
+    }
+    qsort(vp, len, sizeof(value_pos), _value_pos_compare);
+    for(p = 0; p < len; ++p)
+        prev[vp[p].pos] = (p && vp[p-1].value == vp[p].value) ? vp[p-1].pos : -1;
+    free(vp);
+
+    wt_tree *tree = wt_new_bounded(-1, len ? len - 1 : -1);
+    wt_build(tree, prev, len);
+    free(prev);
+    return tree;
+}
+
 void wt_build(wt_tree *tree, int32_t *data, size_t len) {
     tree->len = len;
 
-    _wt_build(tree->root, data, len, MIN_ALPHABET, MAX_ALPHABET);
+    if (tree->flags & WT_FLAG_DISTINCT)
+        tree->prev = _wt_build_prev(data, len);
+
+    // the parallel build partitions through a scratch buffer and leaves data
+    // permuted, so it is only used when the build may destroy data anyway
+    if (DESTRUCTIVE_BUILD && _wt_build_threads > 1 && WT_PARALLEL_MIN <= len) {
+        wt_build_task task = { tree->root, data, malloc(len * sizeof(int32_t)), len,
+            tree->lower, tree->upper, tree->flags, _wt_build_threads };
+        _wt_build_parallel(&task);
+        free(task.scratch);
+        return;
+    }
+
+    _wt_build(tree->root, data, len, tree->lower, tree->upper, tree->flags);
 }
 
 void wt_node_free(wt_node *cur) {
     if (cur->left) wt_node_free(cur->left);
     if (cur->right) wt_node_free(cur->right);
     if (cur->fid) fid_free(cur->fid);
+    if (cur->sums) free(cur->sums);
     free(cur);
 }
 
 void wt_free(wt_tree *tree) {
+    if (tree->prev) wt_free(tree->prev);
     wt_node_free(tree->root);
     free(tree);
 }
 
+size_t fid_memory_usage(const fid *fid) {
+    return sizeof(*fid) +
+        FID_NWORDS(fid, fid->n) * sizeof(uint64_t) +
+        FID_NSUPERBLOCKS(fid, fid->n) * sizeof(uint64_t);
+}
+
+static size_t _wt_node_memory_usage(const wt_node *cur) {
+    size_t size = sizeof(*cur);
+    if (cur->fid) size += fid_memory_usage(cur->fid);
+    if (cur->sums) size += (cur->n + 1) * sizeof(int64_t);
+    if (cur->left) size += _wt_node_memory_usage(cur->left);
+    if (cur->right) size += _wt_node_memory_usage(cur->right);
+    return size;
+}
+
+size_t wt_memory_usage(const wt_tree *tree) {
+    size_t size = sizeof(*tree) + _wt_node_memory_usage(tree->root);
+    if (tree->prev) size += wt_memory_usage(tree->prev);
+    return size;
+}
+
+static void _wt_level_usage_add(wt_level_usage *dst, const wt_level_usage *src) {
+    dst->nodes += src->nodes;
+    dst->bits += src->bits;
+    dst->headers += src->headers;
+    dst->bs += src->bs;
+    dst->rd += src->rd;
+    dst->sums += src->sums;
+}
+
+static void _wt_memory_report(const wt_node *cur, size_t depth, int32_t lower, int32_t upper, wt_usage *usage) {
+    wt_level_usage node = {1, 0, sizeof(*cur), 0, 0, 0};
+    if (cur->fid) {
+        const fid *fid = cur->fid;
+        node.bits = fid->n;
+        node.headers += sizeof(*fid);
+        node.bs = FID_NWORDS(fid, fid->n) * sizeof(uint64_t);
+        node.rd = FID_NSUPERBLOCKS(fid, fid->n) * sizeof(uint64_t);
+    }
+    if (cur->sums) node.sums = (cur->n + 1) * sizeof(int64_t);
+
+    _wt_level_usage_add(&usage->levels[depth], &node);
+    _wt_level_usage_add(&usage->total, &node);
+    if (usage->height < depth) usage->height = depth;
+    if (lower == upper && cur->n) ++usage->distinct;
+
+    int32_t mid = MID(lower, upper);
+    if (cur->left) _wt_memory_report(cur->left, depth + 1, lower, mid, usage);
+    if (cur->right) _wt_memory_report(cur->right, depth + 1, mid + 1, upper, usage);
+}
+
+// Breaks the memory of tree down per level and per component.
+void wt_memory_report(const wt_tree *tree, wt_usage *usage) {
+    memset(usage, 0, sizeof(*usage));
+    usage->len = tree->len;
+    if (tree->root) _wt_memory_report(tree->root, 0, tree->lower, tree->upper, usage);
+    usage->nodes = usage->total.nodes;
+    usage->total.headers += sizeof(*tree);
+    usage->aux = tree->prev ? wt_memory_usage(tree->prev) : 0;
+    usage->bytes = usage->total.headers + usage->total.bs + usage->total.rd + usage->total.sums + usage->aux;
+}
+
 int wt_access(const wt_tree *tree, size_t i, int32_t *res) {
     wt_node *cur = tree->root;
-    int32_t lower = MIN_ALPHABET, upper = MAX_ALPHABET;
+    int32_t lower = tree->lower, upper = tree->upper;
     while (cur && lower < upper) {
+        WT_STAT_INC(nodes_visited);
         int32_t mid = MID(lower, upper);
         if (fid_rank(cur->fid, 0, i+1) - fid_rank(cur->fid, 0, i)) {
             i = fid_rank(cur->fid, 0, i);
@@ -247,10 +522,48 @@ int wt_access(const wt_tree *tree, size_t i, int32_t *res) {
     return cur && lower == upper;
 }
 
+// Decodes [i, j) of cur into out, using tmp (same length) as scratch space.
+// Children are decoded into tmp and then merged into out by scanning the
+// bits of cur sequentially.
+void _wt_get_range(const wt_node *cur, size_t i, size_t j, int32_t lower, int32_t upper, int32_t *out, int32_t *tmp) {
+    WT_STAT_INC(nodes_visited);
+    size_t p, n = j - i;
+    if (lower == upper) {
+        for(p = 0; p < n; ++p)
+            out[p] = lower;
+        return;
+    }
+
+    int32_t mid = MID(lower, upper);
+    fid_ranks rk = fid_rank_range(cur->fid, i, j);
+    size_t nl = rk.j0 - rk.i0;
+    if (nl)
+        _wt_get_range(cur->left, rk.i0, rk.j0, lower, mid, tmp, out);
+    if (n - nl)
+        _wt_get_range(cur->right, rk.i1, rk.j1, mid + 1, upper, tmp + nl, out + nl);
+
+    int32_t *l = tmp, *r = tmp + nl;
+    for(p = 0; p < n; ++p)
+        out[p] = fid_access(cur->fid, i + p) ? *(r++) : *(l++);
+}
+
+size_t wt_get_range(const wt_tree *tree, size_t i, size_t j, int32_t *out) {
+    if (tree->len < j) j = tree->len;
+    if (j <= i) return 0;
+
+    int32_t *tmp = malloc((j - i) * sizeof(int32_t));
+    _wt_get_range(tree->root, i, j, tree->lower, tree->upper, out, tmp);
+    free(tmp);
+    return j - i;
+}
+
 int wt_rank(const wt_tree *tree, int32_t value, int i) {
+    if (value < tree->lower || tree->upper < value) return 0;
+
     wt_node *cur = tree->root;
-    int32_t lower = MIN_ALPHABET, upper = MAX_ALPHABET;
+    int32_t lower = tree->lower, upper = tree->upper;
     while (lower < upper) {
+        WT_STAT_INC(nodes_visited);
         int32_t mid = MID(lower, upper);
 
         if (value <= mid) {
@@ -271,9 +584,12 @@ int wt_rank(const wt_tree *tree, int32_t value, int i) {
 
 
 int wt_select(const wt_tree *tree, int32_t v, size_t i) {
+    if (v < tree->lower || tree->upper < v) return -1;
+
     wt_node *cur = tree->root;
-    int32_t lower = MIN_ALPHABET, upper = MAX_ALPHABET;
+    int32_t lower = tree->lower, upper = tree->upper;
     while (lower < upper) {
+        WT_STAT_INC(nodes_visited);
         int32_t mid = MID(lower, upper);
 
         if (v <= mid) {
@@ -292,6 +608,7 @@ int wt_select(const wt_tree *tree, int32_t v, size_t i) {
 
     --i;
     while (cur->parent) {
+        WT_STAT_INC(nodes_visited);
         int left = cur == cur->parent->left;
         cur = cur->parent;
         i = fid_select(cur->fid, left ? 0 : 1, i + 1);
@@ -300,26 +617,124 @@ int wt_select(const wt_tree *tree, int32_t v, size_t i) {
     return i;
 }
 
+/*
+ * Occurrence navigation
+ */
+
+// Descends to the leaf of v, mapping [*i, *j) to the corresponding range of the leaf.
+static const wt_node *_wt_value_leaf(const wt_tree *tree, int32_t v, size_t *i, size_t *j) {
+    if (v < tree->lower || tree->upper < v) return NULL;
+    if (tree->len < *j) *j = tree->len;
+    if (*j < *i) *i = *j;
+
+    const wt_node *cur = tree->root;
+    int32_t lower = tree->lower, upper = tree->upper;
+    while (cur && lower < upper) {
+        WT_STAT_INC(nodes_visited);
+        int32_t mid = MID(lower, upper);
+        fid_ranks r = fid_rank_range(cur->fid, *i, *j);
+        if (mid < v) {
+            *i = r.i1;
+            *j = r.j1;
+            lower = mid + 1;
+            cur = cur->right;
+        }
+        else {
+            *i = r.i0;
+            *j = r.j0;
+            upper = mid;
+            cur = cur->left;
+        }
+    }
+    return cur;
+}
+
+// Replaces the ascending 0-based ranks ks[0..n) of the b bits with their positions.
+// The next b bit of a consecutive rank is first looked for in the rest of the
+// current word, which makes lifting runs of occurrences close to a linear scan.
+static void _fid_select_batch(fid *fid, int b, size_t *ks, size_t n) {
+    size_t p, k, prev_k = 0, pos = 0;
+    for(p = 0; p < n; ++p) {
+        k = ks[p];
+        uint64_t word = 0;
+        if (p && k == prev_k + 1 && (pos & FID_MASK_WI(fid)) != FID_MASK_WI(fid)) {
+            word = fid->bs[FID_I2WI(fid, pos)];
+            if (!b) word = ~word;
+            word &= ~0ULL << ((pos & FID_MASK_WI(fid)) + 1);
+        }
+        if (word)
+            pos = (pos & ~(size_t)FID_MASK_WI(fid)) + __builtin_ctzll(word);
+        else
+            pos = fid_select(fid, b, k + 1);
+        prev_k = k;
+        ks[p] = pos;
+    }
+}
+
+// Lifts the ascending offsets res[0..n) within leaf to positions of the sequence.
+static void _wt_leaf_select(const wt_node *leaf, size_t *res, size_t n) {
+    const wt_node *cur = leaf;
+    while (cur->parent) {
+        WT_STAT_INC(nodes_visited);
+        int b = cur != cur->parent->left;
+        cur = cur->parent;
+        _fid_select_batch(cur->fid, b, res, n);
+    }
+}
+
+int wt_next_pos(const wt_tree *tree, int32_t v, size_t i) {
+    size_t j = tree->len;
+    const wt_node *leaf = _wt_value_leaf(tree, v, &i, &j);
+    if (!leaf || j <= i) return -1;
+
+    _wt_leaf_select(leaf, &i, 1);
+    return i;
+}
+
+int wt_prev_pos(const wt_tree *tree, int32_t v, size_t j) {
+    size_t i = 0;
+    const wt_node *leaf = _wt_value_leaf(tree, v, &i, &j);
+    if (!leaf || j <= i) return -1;
+
+    --j;
+    _wt_leaf_select(leaf, &j, 1);
+    return j;
+}
+
+size_t wt_positions(const wt_tree *tree, int32_t v, size_t i, size_t j, size_t offset, size_t count, size_t *res, size_t *total) {
+    const wt_node *leaf = _wt_value_leaf(tree, v, &i, &j);
+    if (total) *total = leaf ? j - i : 0;
+    if (!leaf || j <= i + offset) return 0;
+
+    size_t p, n = j - i - offset < count ? j - i - offset : count;
+    for(p = 0; p < n; ++p)
+        res[p] = i + offset + p;
+    _wt_leaf_select(leaf, res, n);
+    return n;
+}
+
 int wt_quantile(const wt_tree *tree, size_t i, size_t j, size_t k, int32_t *res) {
     if (j <= i || i - j < k)
         return 0;
 
     wt_node *cur = tree->root;
-    int32_t lower = MIN_ALPHABET, upper = MAX_ALPHABET;
+    int32_t lower = tree->lower, upper = tree->upper;
     while (cur && lower < upper) {
+        WT_STAT_INC(nodes_visited);
         int32_t mid = MID(lower, upper);
 
-        int ln = fid_rank(cur->fid, 0, j) - fid_rank(cur->fid, 0, i);
+        fid_ranks r = fid_rank_range(cur->fid, i, j);
+        int ln = r.j0 - r.i0;
         if (k <= ln) {
-            i = fid_rank(cur->fid, 0, i);
-            j = fid_rank(cur->fid, 0, j);
+            i = r.i0;
+            j = r.j0;
             upper = mid;
             cur = cur->left;
         }
         else {
             k -= ln;
-            i = fid_rank(cur->fid, 1, i);
-            j = fid_rank(cur->fid, 1, j);
+            i = r.i1;
+            j = r.j1;
             lower = mid + 1;
             cur = cur->right;
         }
@@ -328,23 +743,124 @@ int wt_quantile(const wt_tree *tree, size_t i, size_t j, size_t k, int32_t *res)
     return cur && lower == upper && k <= i - j;
 }
 
+void _wt_quantiles(const wt_node *cur, size_t i, size_t j, size_t *ks, size_t n, int32_t *res, int32_t lower, int32_t upper) {
+    WT_STAT_INC(nodes_visited);
+    size_t p, q;
+    if (lower == upper) {
+        for(p = 0; p < n; ++p)
+            res[p] = lower;
+        return;
+    }
+
+    int32_t mid = MID(lower, upper);
+    fid_ranks r = fid_rank_range(cur->fid, i, j);
+    size_t ln = r.j0 - r.i0;
+
+    // ks is sorted, so the ones going left form a prefix
+    for(p = 0; p < n && ks[p] <= ln; ++p);
+
+    if (p)
+        _wt_quantiles(cur->left, r.i0, r.j0, ks, p, res, lower, mid);
+    if (p < n) {
+        for(q = p; q < n; ++q)
+            ks[q] -= ln;
+        _wt_quantiles(cur->right, r.i1, r.j1, ks + p, n - p, res + p, mid + 1, upper);
+    }
+}
+
+int wt_quantiles(const wt_tree *tree, size_t i, size_t j, const size_t *ks, size_t n, int32_t *res) {
+    if (tree->len < j) j = tree->len;
+    if (!n || j <= i || !ks[0] || j - i < ks[n-1])
+        return 0;
+
+    size_t *work = malloc(n * sizeof(size_t));
+    memcpy(work, ks, n * sizeof(size_t));
+    _wt_quantiles(tree->root, i, j, work, n, res, tree->lower, tree->upper);
+    free(work);
+    return n;
+}
+
 #define RANGE_FLAG_LEFT  0x1
 #define RANGE_FLAG_RIGHT 0x2
 #define RANGE_FLAG_BOTH (RANGE_FLAG_LEFT|RANGE_FLAG_RIGHT)
 
+int wt_quantile_approx(const wt_tree *tree, size_t i, size_t j, size_t k, int depth, int32_t *lower_res, int32_t *upper_res) {
+    if (tree->len < j) j = tree->len;
+    if (j <= i || k == 0 || j - i < k)
+        return 0;
+
+    const wt_node *cur = tree->root;
+    int32_t lower = tree->lower, upper = tree->upper;
+    while (cur && lower < upper && depth-- > 0) {
+        WT_STAT_INC(nodes_visited);
+        int32_t mid = MID(lower, upper);
+
+        fid_ranks r = fid_rank_range(cur->fid, i, j);
+        size_t ln = r.j0 - r.i0;
+        if (k <= ln) {
+            i = r.i0;
+            j = r.j0;
+            upper = mid;
+            cur = cur->left;
+        }
+        else {
+            k -= ln;
+            i = r.i1;
+            j = r.j1;
+            lower = mid + 1;
+            cur = cur->right;
+        }
+    }
+    *lower_res = lower;
+    *upper_res = upper;
+    return cur != NULL;
+}
+
+static void _wt_range_freq_approx(const wt_node *cur, size_t i, size_t j, int32_t x, int32_t y, int32_t lower, int32_t upper, int depth,
+    int *lower_res, int *upper_res) {
+    WT_STAT_INC(nodes_visited);
+    if (!cur || j <= i || upper < x || y < lower)
+        return;
+    if (x <= lower && upper <= y) {
+        *lower_res += j - i;
+        *upper_res += j - i;
+        return;
+    }
+    // the node straddles a bound, so anywhere from none to all of its elements may match
+    if (depth == 0) {
+        *upper_res += j - i;
+        return;
+    }
+
+    int32_t mid = MID(lower, upper);
+    fid_ranks r = fid_rank_range(cur->fid, i, j);
+    _wt_range_freq_approx(cur->left, r.i0, r.j0, x, y, lower, mid, depth - 1, lower_res, upper_res);
+    _wt_range_freq_approx(cur->right, r.i1, r.j1, x, y, mid + 1, upper, depth - 1, lower_res, upper_res);
+}
+
+void wt_range_freq_approx(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_t y, int depth, int *lower_res, int *upper_res) {
+    *lower_res = *upper_res = 0;
+    if (y <= x) return;
+    if (tree->len < j) j = tree->len;
+    _wt_range_freq_approx(tree->root, i, j, x, y, tree->lower, tree->upper, depth, lower_res, upper_res);
+}
+
 static inline const wt_node *_wt_range_branch(wt_node *cur, size_t *i, size_t *j, int32_t x, int32_t y, int32_t *lower, int32_t *upper) {
     int32_t mid;
     while (cur && *lower < *upper) {
+        WT_STAT_INC(nodes_visited);
         mid = MID(*lower, *upper);
         if (y <= mid) {
-            *i = fid_rank(cur->fid, 0, *i);
-            *j = fid_rank(cur->fid, 0, *j);
+            fid_ranks r = fid_rank_range(cur->fid, *i, *j);
+            *i = r.i0;
+            *j = r.j0;
             *upper = mid;
             cur = cur->left;
         }
         else if (mid < x) {
-            *i = fid_rank(cur->fid, 1, *i);
-            *j = fid_rank(cur->fid, 1, *j);
+            fid_ranks r = fid_rank_range(cur->fid, *i, *j);
+            *i = r.i1;
+            *j = r.j1;
             *lower = mid + 1;
             cur = cur->right;
         }
@@ -358,20 +874,22 @@ int _wt_range_freq_half(const wt_node *cur, size_t i, size_t j, int32_t boundary
     int freq = 0;
     int32_t mid;
     while (cur && lower < upper) {
+        WT_STAT_INC(nodes_visited);
         mid = MID(lower, upper);
+        fid_ranks r = fid_rank_range(cur->fid, i, j);
         if (boundary <= mid) {
             if ((flags & RANGE_FLAG_RIGHT) && cur->right)
-                freq += fid_rank(cur->fid, 1, j) - fid_rank(cur->fid, 1, i);
-            i = fid_rank(cur->fid, 0, i);
-            j = fid_rank(cur->fid, 0, j);
+                freq += r.j1 - r.i1;
+            i = r.i0;
+            j = r.j0;
             upper = mid;
             cur = cur->left;
         }
         else {
             if ((flags & RANGE_FLAG_LEFT) && cur->left)
-                freq += fid_rank(cur->fid, 0, j) - fid_rank(cur->fid, 0, i);
-            i = fid_rank(cur->fid, 1, i);
-            j = fid_rank(cur->fid, 1, j);
+                freq += r.j0 - r.i0;
+            i = r.i1;
+            j = r.j1;
             lower = mid + 1;
             cur = cur->right;
         }
@@ -383,48 +901,184 @@ int _wt_range_freq_half(const wt_node *cur, size_t i, size_t j, int32_t boundary
 int wt_range_freq(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_t y) {
     if (y <= x) return 0;
 
-    int32_t lower = MIN_ALPHABET, upper = MAX_ALPHABET;
+    int32_t lower = tree->lower, upper = tree->upper;
     const wt_node *cur = _wt_range_branch(tree->root, &i, &j, x, y, &lower, &upper);
     if (!cur || j <= i) return 0;
     if (lower == upper) return j - i;
 
-    return _wt_range_freq_half(cur->left, fid_rank(cur->fid, 0, i), fid_rank(cur->fid, 0, j), x, RANGE_FLAG_RIGHT, lower, MID(lower, upper)) +
-        _wt_range_freq_half(cur->right, fid_rank(cur->fid, 1, i), fid_rank(cur->fid, 1, j), y, RANGE_FLAG_LEFT, MID(lower, upper) + 1, upper);
+    fid_ranks r = fid_rank_range(cur->fid, i, j);
+    return _wt_range_freq_half(cur->left, r.i0, r.j0, x, RANGE_FLAG_RIGHT, lower, MID(lower, upper)) +
+        _wt_range_freq_half(cur->right, r.i1, r.j1, y, RANGE_FLAG_LEFT, MID(lower, upper) + 1, upper);
+}
+
+// Stores the number of elements less than edges[p] into out[p] for each of
+// the sorted edges, partitioning the edges between the children at each node.
+void _wt_range_count_less(const wt_node *cur, size_t i, size_t j, const int32_t *edges, size_t n, int base, int *out, int32_t lower, int32_t upper) {
+    WT_STAT_INC(nodes_visited);
+    size_t p = 0, q = n, r;
+    while (p < q && edges[p] <= lower)
+        out[p++] = base;
+    while (p < q && upper < edges[q-1])
+        out[--q] = base + (j - i);
+    if (p == q) return;
+
+    if (!cur || j <= i) {
+        for(r = p; r < q; ++r)
+            out[r] = base;
+        return;
+    }
+
+    int32_t mid = MID(lower, upper);
+    fid_ranks rk = fid_rank_range(cur->fid, i, j);
+    for(r = p; r < q && edges[r] <= mid; ++r);
+
+    if (p < r)
+        _wt_range_count_less(cur->left, rk.i0, rk.j0, edges + p, r - p, base, out + p, lower, mid);
+    if (r < q)
+        _wt_range_count_less(cur->right, rk.i1, rk.j1, edges + r, q - r, base + (rk.j0 - rk.i0), out + r, mid + 1, upper);
+}
+
+int wt_range_hist(const wt_tree *tree, size_t i, size_t j, const int32_t *edges, size_t m, int *counts) {
+    if (m < 2) return 0;
+    if (tree->len < j) j = tree->len;
+    if (j < i) j = i;
+
+    size_t p;
+    int *less = malloc(m * sizeof(int));
+    _wt_range_count_less(tree->root, i, j, edges, m, 0, less, tree->lower, tree->upper);
+    for(p = 0; p + 1 < m; ++p)
+        counts[p] = less[p+1] - less[p];
+    free(less);
+    return m - 1;
+}
+
+int wt_range_less(const wt_tree *tree, size_t i, size_t j, int32_t value) {
+    if (tree->len < j) j = tree->len;
+    if (j <= i) return 0;
+
+    int res;
+    _wt_range_count_less(tree->root, i, j, &value, 1, 0, &res, tree->lower, tree->upper);
+    return res;
+}
+
+int wt_range_distinct(const wt_tree *tree, size_t i, size_t j) {
+    if (!tree->prev) return -1;
+    if (tree->len < j) j = tree->len;
+    if (j <= i) return 0;
+
+    return wt_range_less(tree->prev, i, j, i);
+}
+
+static inline int64_t _wt_node_sum(const wt_node *cur, size_t i, size_t j, int32_t lower, int32_t upper) {
+    if (!cur || j <= i) return 0;
+    if (lower == upper) return (int64_t)lower * (int64_t)(j - i);
+    return cur->sums[j] - cur->sums[i];
+}
+
+// Sum of the elements less than edge in [i, j) of cur
+int64_t _wt_range_sum_less(const wt_node *cur, size_t i, size_t j, int64_t edge, int32_t lower, int32_t upper) {
+    int64_t sum = 0;
+    int32_t mid;
+    while (cur && i < j && lower < edge) {
+        WT_STAT_INC(nodes_visited);
+        if (upper < edge)
+            return sum + _wt_node_sum(cur, i, j, lower, upper);
+
+        mid = MID(lower, upper);
+        fid_ranks r = fid_rank_range(cur->fid, i, j);
+        if (edge <= mid) {
+            i = r.i0;
+            j = r.j0;
+            upper = mid;
+            cur = cur->left;
+        }
+        else {
+            sum += _wt_node_sum(cur->left, r.i0, r.j0, lower, mid);
+            i = r.i1;
+            j = r.j1;
+            lower = mid + 1;
+            cur = cur->right;
+        }
+    }
+    return sum;
+}
+
+int64_t wt_range_sum(const wt_tree *tree, size_t i, size_t j, int64_t x, int64_t y) {
+    if (!(tree->flags & WT_FLAG_SUMS) || y <= x) return 0;
+    if (tree->len < j) j = tree->len;
+    if (j <= i) return 0;
+
+    return _wt_range_sum_less(tree->root, i, j, y, tree->lower, tree->upper) -
+        _wt_range_sum_less(tree->root, i, j, x, tree->lower, tree->upper);
+}
+
+int64_t wt_kth_sum(const wt_tree *tree, size_t i, size_t j, size_t k) {
+    if (!(tree->flags & WT_FLAG_SUMS)) return 0;
+    if (tree->len < j) j = tree->len;
+    if (j <= i || !k) return 0;
+    if (j - i < k) k = j - i;
+
+    const wt_node *cur = tree->root;
+    int64_t sum = 0;
+    int32_t mid, lower = tree->lower, upper = tree->upper;
+    while (cur && lower < upper) {
+        WT_STAT_INC(nodes_visited);
+        mid = MID(lower, upper);
+        fid_ranks r = fid_rank_range(cur->fid, i, j);
+        if (k <= r.j0 - r.i0) {
+            i = r.i0;
+            j = r.j0;
+            upper = mid;
+            cur = cur->left;
+        }
+        else {
+            sum += _wt_node_sum(cur->left, r.i0, r.j0, lower, mid);
+            k -= r.j0 - r.i0;
+            i = r.i1;
+            j = r.j1;
+            lower = mid + 1;
+            cur = cur->right;
+        }
+    }
+    return sum + (int64_t)lower * (int64_t)k;
 }
 
 int _wt_range_list_half(const wt_node *cur, size_t i, size_t j, int32_t boundary, int flags, int32_t lower, int32_t upper,
-    void (*callback)(void*, int32_t, int), void *user_data) {
+    wt_budget *budget, void (*callback)(void*, int32_t, int), void *user_data) {
     int32_t mid, len = 0;
-    while (cur && lower < upper) {
+    while (cur && lower < upper && wt_budget_spend(budget)) {
+        WT_STAT_INC(nodes_visited);
         mid = MID(lower, upper);
+        fid_ranks r = fid_rank_range(cur->fid, i, j);
         if (boundary <= mid) {
             if ((flags & RANGE_FLAG_RIGHT) && cur->right)
-                len += _wt_range_list_half(cur->right, fid_rank(cur->fid, 1, i), fid_rank(cur->fid, 1, j), boundary, RANGE_FLAG_BOTH, mid+1, upper, callback, user_data);
-            i = fid_rank(cur->fid, 0, i);
-            j = fid_rank(cur->fid, 0, j);
+                len += _wt_range_list_half(cur->right, r.i1, r.j1, boundary, RANGE_FLAG_BOTH, mid+1, upper, budget, callback, user_data);
+            i = r.i0;
+            j = r.j0;
             upper = mid;
             cur = cur->left;
         }
         else {
             if ((flags & RANGE_FLAG_LEFT) && cur->left)
-                len += _wt_range_list_half(cur->left, fid_rank(cur->fid, 0, i), fid_rank(cur->fid, 0, j), boundary, RANGE_FLAG_BOTH, lower, mid, callback, user_data);
-            i = fid_rank(cur->fid, 1, i);
-            j = fid_rank(cur->fid, 1, j);
+                len += _wt_range_list_half(cur->left, r.i0, r.j0, boundary, RANGE_FLAG_BOTH, lower, mid, budget, callback, user_data);
+            i = r.i1;
+            j = r.j1;
             lower = mid + 1;
             cur = cur->right;
         }
     }
-    if (cur && i < j) {
+    if (cur && lower == upper && i < j) {
         callback(user_data, lower, j - i);
         ++len;
     }
     return len;
 }
 
-int wt_range_list(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_t y, void (*callback)(void*, int32_t, int), void *user_data) {
+int wt_range_list_budget(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_t y, wt_budget *budget,
+    void (*callback)(void*, int32_t, int), void *user_data) {
     if (y <= x) return 0;
 
-    int32_t lower = MIN_ALPHABET, upper = MAX_ALPHABET;
+    int32_t lower = tree->lower, upper = tree->upper;
     const wt_node *cur = _wt_range_branch(tree->root, &i, &j, x, y, &lower, &upper);
     if (!cur || j <= i) return 0;
     if (lower == upper) {
@@ -435,33 +1089,40 @@ int wt_range_list(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_t y,
         return 0;
     }
 
-    return _wt_range_list_half(cur->left, fid_rank(cur->fid, 0, i), fid_rank(cur->fid, 0, j), x, RANGE_FLAG_RIGHT, lower, MID(lower, upper), callback, user_data) +
-        _wt_range_list_half(cur->right, fid_rank(cur->fid, 1, i), fid_rank(cur->fid, 1, j), y, RANGE_FLAG_LEFT, MID(lower, upper) + 1, upper, callback, user_data);
+    fid_ranks r = fid_rank_range(cur->fid, i, j);
+    return _wt_range_list_half(cur->left, r.i0, r.j0, x, RANGE_FLAG_RIGHT, lower, MID(lower, upper), budget, callback, user_data) +
+        _wt_range_list_half(cur->right, r.i1, r.j1, y, RANGE_FLAG_LEFT, MID(lower, upper) + 1, upper, budget, callback, user_data);
+}
+
+int wt_range_list(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_t y, void (*callback)(void*, int32_t, int), void *user_data) {
+    return wt_range_list_budget(tree, i, j, x, y, NULL, callback, user_data);
 }
 
 int32_t wt_prev_value(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_t y) {
     y -= 1;
     const wt_node *cur = tree->root, *last_left_node = NULL;
     int last_left_i, last_left_j;
-    int32_t mid, last_left_lower, last_left_upper, lower = MIN_ALPHABET, upper = MAX_ALPHABET;
+    int32_t mid, last_left_lower, last_left_upper, lower = tree->lower, upper = tree->upper;
     while (cur && lower < upper) {
+        WT_STAT_INC(nodes_visited);
         mid = MID(lower, upper);
+        fid_ranks r = fid_rank_range(cur->fid, i, j);
         if (y <= mid) {
-            i = fid_rank(cur->fid, 0, i);
-            j = fid_rank(cur->fid, 0, j);
+            i = r.i0;
+            j = r.j0;
             upper = mid;
             cur = cur->left;
         }
         else {
-            if (x <= mid && cur->left && fid_rank(cur->fid, 0, i) < fid_rank(cur->fid, 0, j)) {
+            if (x <= mid && cur->left && r.i0 < r.j0) {
                 last_left_node = cur->left;
                 last_left_lower = lower;
                 last_left_upper = mid;
-                last_left_i = fid_rank(cur->fid, 0, i);
-                last_left_j = fid_rank(cur->fid, 0, j);
+                last_left_i = r.i0;
+                last_left_j = r.j0;
             }
-            i = fid_rank(cur->fid, 1, i);
-            j = fid_rank(cur->fid, 1, j);
+            i = r.i1;
+            j = r.j1;
             lower = mid+1;
             cur = cur->right;
         }
@@ -475,16 +1136,18 @@ int32_t wt_prev_value(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_
         upper = last_left_upper;
         cur = last_left_node;
         while (lower < upper) {
+            WT_STAT_INC(nodes_visited);
             mid = MID(lower, upper);
-            if (cur->right && fid_rank(cur->fid, 1, i) < fid_rank(cur->fid, 1, j)) {
-                i = fid_rank(cur->fid, 1, i);
-                j = fid_rank(cur->fid, 1, j);
+            fid_ranks r = fid_rank_range(cur->fid, i, j);
+            if (cur->right && r.i1 < r.j1) {
+                i = r.i1;
+                j = r.j1;
                 lower = mid + 1;
                 cur = cur->right;
             }
             else {
-                i = fid_rank(cur->fid, 0, i);
-                j = fid_rank(cur->fid, 0, j);
+                i = r.i0;
+                j = r.j0;
                 upper = mid;
                 cur = cur->left;
             }
@@ -498,25 +1161,27 @@ int32_t wt_next_value(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_
     x += 1;
     const wt_node *cur = tree->root, *last_right_node = NULL;
     int last_right_i, last_right_j;
-    int32_t mid, last_right_lower, last_right_upper, lower = MIN_ALPHABET, upper = MAX_ALPHABET;
+    int32_t mid, last_right_lower, last_right_upper, lower = tree->lower, upper = tree->upper;
     while (cur && lower < upper) {
+        WT_STAT_INC(nodes_visited);
         mid = MID(lower, upper);
+        fid_ranks r = fid_rank_range(cur->fid, i, j);
         if (mid < x) {
-            i = fid_rank(cur->fid, 1, i);
-            j = fid_rank(cur->fid, 1, j);
+            i = r.i1;
+            j = r.j1;
             lower = mid + 1;
             cur = cur->right;
         }
         else {
-            if (mid < y && cur->right && fid_rank(cur->fid, 1, i) < fid_rank(cur->fid, 1, j)) {
+            if (mid < y && cur->right && r.i1 < r.j1) {
                 last_right_node = cur->right;
                 last_right_lower = mid + 1;
                 last_right_upper = upper;
-                last_right_i = fid_rank(cur->fid, 1, i);
-                last_right_j = fid_rank(cur->fid, 1, j);
+                last_right_i = r.i1;
+                last_right_j = r.j1;
             }
-            i = fid_rank(cur->fid, 0, i);
-            j = fid_rank(cur->fid, 0, j);
+            i = r.i0;
+            j = r.j0;
             upper = mid;
             cur = cur->left;
         }
@@ -530,16 +1195,18 @@ int32_t wt_next_value(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_
         upper = last_right_upper;
         cur = last_right_node;
         while (lower < upper) {
+            WT_STAT_INC(nodes_visited);
             mid = MID(lower, upper);
-            if (cur->left && fid_rank(cur->fid, 0, i) < fid_rank(cur->fid, 0, j)) {
-                i = fid_rank(cur->fid, 0, i);
-                j = fid_rank(cur->fid, 0, j);
+            fid_ranks r = fid_rank_range(cur->fid, i, j);
+            if (cur->left && r.i0 < r.j0) {
+                i = r.i0;
+                j = r.j0;
                 upper = mid;
                 cur = cur->left;
             }
             else {
-                i = fid_rank(cur->fid, 1, i);
-                j = fid_rank(cur->fid, 1, j);
+                i = r.i1;
+                j = r.j1;
                 lower = mid + 1;
                 cur = cur->right;
             }
@@ -570,15 +1237,17 @@ void topk_qe_free(topk_qe *qe) {
     free(qe);
 }
 
-int wt_topk(const wt_tree *tree, size_t i, size_t j, size_t k, void (*callback)(void*, int32_t, int), void *user_data) {
+int wt_topk_budget(const wt_tree *tree, size_t i, size_t j, size_t k, wt_budget *budget,
+    void (*callback)(void*, int32_t, int), void *user_data) {
     heap *q = heap_new();
-    heap_push(q, j - i, topk_qe_new(tree->root, i, j, MIN_ALPHABET, MAX_ALPHABET));
+    heap_push(q, j - i, topk_qe_new(tree->root, i, j, tree->lower, tree->upper));
 
-    int score, count = 0, ni, nj;
+    int score, count = 0;
     topk_qe *qe;
     int32_t mid;
-    while (count < k && heap_len(q) > 0) {
+    while (count < k && heap_len(q) > 0 && wt_budget_spend(budget)) {
         heap_pop(q, &score, (void**)&qe);
+        WT_STAT_INC(nodes_visited);
 
         if (qe->lower == qe->upper) {
             ++count;
@@ -586,18 +1255,15 @@ int wt_topk(const wt_tree *tree, size_t i, size_t j, size_t k, void (*callback)(
         }
         else {
             mid = MID(qe->lower, qe->upper);
+            fid_ranks r = fid_rank_range(qe->node->fid, qe->i, qe->j);
 
             // left
-            ni = fid_rank(qe->node->fid, 0, qe->i);
-            nj = fid_rank(qe->node->fid, 0, qe->j);
-            if (ni < nj)
-                heap_push(q, nj - ni, topk_qe_new(qe->node->left, ni, nj, qe->lower, mid));
+            if (r.i0 < r.j0)
+                heap_push(q, r.j0 - r.i0, topk_qe_new(qe->node->left, r.i0, r.j0, qe->lower, mid));
 
             // right
-            ni = fid_rank(qe->node->fid, 1, qe->i);
-            nj = fid_rank(qe->node->fid, 1, qe->j);
-            if (ni < nj)
-                heap_push(q, nj - ni, topk_qe_new(qe->node->right, ni, nj, mid+1, qe->upper));
+            if (r.i1 < r.j1)
+                heap_push(q, r.j1 - r.i1, topk_qe_new(qe->node->right, r.i1, r.j1, mid+1, qe->upper));
         }
 
         topk_qe_free(qe);
@@ -607,11 +1273,336 @@ int wt_topk(const wt_tree *tree, size_t i, size_t j, size_t k, void (*callback)(
     return count;
 }
 
+int wt_topk(const wt_tree *tree, size_t i, size_t j, size_t k, void (*callback)(void*, int32_t, int), void *user_data) {
+    return wt_topk_budget(tree, i, j, k, NULL, callback, user_data);
+}
+
+/*
+ * Sliding windows
+ */
+
+// Overlapping windows share their endpoints, so ranks are memoized by
+// (node, position) while sliding over the range.
+typedef struct rank_cache_entry {
+    const wt_node *node;
+    size_t pos, rank;
+} rank_cache_entry;
+
+#define RANK_CACHE_SIZE 4096
+
+static inline size_t _wt_cached_rank0(rank_cache_entry *cache, const wt_node *node, size_t pos) {
+    rank_cache_entry *e = cache + ((((uintptr_t)node >> 4) ^ (pos * 0x9E3779B1)) & (RANK_CACHE_SIZE - 1));
+    if (e->node != node || e->pos != pos) {
+        e->node = node;
+        e->pos = pos;
+        e->rank = fid_rank(node->fid, 0, pos);
+    }
+    return e->rank;
+}
+
+size_t wt_sliding_windows(const wt_tree *tree, size_t i, size_t j, size_t window, size_t step) {
+    if (tree->len < j) j = tree->len;
+    if (!window || !step || j < i || j - i < window) return 0;
+    return (j - i - window) / step + 1;
+}
+
+size_t wt_sliding_quantile(const wt_tree *tree, size_t i, size_t j, size_t window, size_t step, size_t k, int32_t *res) {
+    size_t w, n = wt_sliding_windows(tree, i, j, window, step);
+    if (!n || !k || window < k) return 0;
+
+    rank_cache_entry *cache = calloc(RANK_CACHE_SIZE, sizeof(rank_cache_entry));
+    for(w = 0; w < n; ++w) {
+        const wt_node *cur = tree->root;
+        int32_t mid, lower = tree->lower, upper = tree->upper;
+        size_t a = i + w * step, b = a + window, kk = k, la, lb;
+        while (cur && lower < upper) {
+            WT_STAT_INC(nodes_visited);
+            mid = MID(lower, upper);
+            la = _wt_cached_rank0(cache, cur, a);
+            lb = _wt_cached_rank0(cache, cur, b);
+            if (kk <= lb - la) {
+                a = la;
+                b = lb;
+                upper = mid;
+                cur = cur->left;
+            }
+            else {
+                kk -= lb - la;
+                a -= la;
+                b -= lb;
+                lower = mid + 1;
+                cur = cur->right;
+            }
+        }
+        res[w] = lower;
+    }
+    free(cache);
+    return n;
+}
+
+size_t wt_sliding_topk(const wt_tree *tree, size_t i, size_t j, size_t window, size_t step, size_t k,
+    void (*window_callback)(void*, size_t), void (*callback)(void*, int32_t, int), void *user_data) {
+    size_t w, n = wt_sliding_windows(tree, i, j, window, step);
+    if (!n) return 0;
+
+    rank_cache_entry *cache = calloc(RANK_CACHE_SIZE, sizeof(rank_cache_entry));
+    heap *q = heap_new();
+    for(w = 0; w < n; ++w) {
+        window_callback(user_data, w);
+
+        size_t a = i + w * step, count = 0, ni, nj;
+        heap_push(q, window, topk_qe_new(tree->root, a, a + window, tree->lower, tree->upper));
+
+        int score;
+        topk_qe *qe;
+        int32_t mid;
+        while (count < k && heap_len(q) > 0) {
+            heap_pop(q, &score, (void**)&qe);
+            WT_STAT_INC(nodes_visited);
+
+            if (qe->lower == qe->upper) {
+                ++count;
+                callback(user_data, qe->lower, qe->j - qe->i);
+            }
+            else {
+                mid = MID(qe->lower, qe->upper);
+                ni = _wt_cached_rank0(cache, qe->node, qe->i);
+                nj = _wt_cached_rank0(cache, qe->node, qe->j);
+
+                // left
+                if (ni < nj)
+                    heap_push(q, nj - ni, topk_qe_new(qe->node->left, ni, nj, qe->lower, mid));
+
+                // right
+                ni = qe->i - ni;
+                nj = qe->j - nj;
+                if (ni < nj)
+                    heap_push(q, nj - ni, topk_qe_new(qe->node->right, ni, nj, mid+1, qe->upper));
+            }
+
+            topk_qe_free(qe);
+        }
+
+        while (heap_pop(q, &score, (void**)&qe))
+            topk_qe_free(qe);
+    }
+    heap_free(q, (void (*)(void*))topk_qe_free);
+    free(cache);
+
+    return n;
+}
+
+/*
+ * Unions of intervals
+ */
+
+static int _wt_interval_compare(const void *a, const void *b) {
+    const wt_interval *x = a, *y = b;
+    return x->i < y->i ? -1 : x->i > y->i;
+}
+
+// Copies the intervals clamped to the tree, sorted and with overlapping ones
+// merged, so that each position of the union is counted once.
+static size_t _wt_normalize_intervals(const wt_tree *tree, const wt_interval *ranges, size_t m, wt_interval *out) {
+    size_t p, n = 0;
+    for(p = 0; p < m; ++p) {
+        out[n] = ranges[p];
+        if (tree->len < out[n].j) out[n].j = tree->len;
+        if (out[n].i < out[n].j) ++n;
+    }
+    qsort(out, n, sizeof(wt_interval), _wt_interval_compare);
+
+    size_t q = 0;
+    for(p = 1; p < n; ++p) {
+        if (out[p].i <= out[q].j) {
+            if (out[q].j < out[p].j) out[q].j = out[p].j;
+        }
+        else
+            out[++q] = out[p];
+    }
+    return n ? q + 1 : 0;
+}
+
+int wt_quantile_multi(const wt_tree *tree, const wt_interval *ranges, size_t m, size_t k, int32_t *res) {
+    wt_interval *work = malloc((m + 1) * sizeof(wt_interval));
+    size_t p, ln, total = 0, n = _wt_normalize_intervals(tree, ranges, m, work);
+    for(p = 0; p < n; ++p)
+        total += work[p].j - work[p].i;
+    if (!k || total < k) {
+        free(work);
+        return 0;
+    }
+
+    const wt_node *cur = tree->root;
+    fid_ranks *ranks = malloc((n + 1) * sizeof(fid_ranks));
+    int32_t mid, lower = tree->lower, upper = tree->upper;
+    while (cur && lower < upper) {
+        WT_STAT_INC(nodes_visited);
+        mid = MID(lower, upper);
+
+        wt_kernels_active->rank_ranges(cur->fid, work, n, ranks);
+        for(p = 0, ln = 0; p < n; ++p)
+            ln += ranks[p].j0 - ranks[p].i0;
+        int left = k <= ln;
+        if (!left) k -= ln;
+        for(p = 0; p < n; ++p) {
+            work[p].i = left ? ranks[p].i0 : ranks[p].i1;
+            work[p].j = left ? ranks[p].j0 : ranks[p].j1;
+        }
+        if (left) {
+            upper = mid;
+            cur = cur->left;
+        }
+        else {
+            lower = mid + 1;
+            cur = cur->right;
+        }
+    }
+    free(ranks);
+    free(work);
+    *res = lower;
+    return cur != NULL;
+}
+
+int wt_range_freq_multi(const wt_tree *tree, const wt_interval *ranges, size_t m, int32_t x, int32_t y) {
+    wt_interval *work = malloc((m + 1) * sizeof(wt_interval));
+    size_t p, n = _wt_normalize_intervals(tree, ranges, m, work);
+    int freq = 0;
+    for(p = 0; p < n; ++p)
+        freq += wt_range_freq(tree, work[p].i, work[p].j, x, y);
+    free(work);
+    return freq;
+}
+
+// Priority queue element for wt_topk_multi
+typedef struct topk_multi_qe {
+    const wt_node *node;
+    int32_t lower, upper;
+    size_t freq;
+    wt_interval ranges[];
+} topk_multi_qe;
+
+static topk_multi_qe *topk_multi_qe_new(const wt_node *node, size_t n, int32_t lower, int32_t upper) {
+    topk_multi_qe *qe = malloc(sizeof(*qe) + n * sizeof(wt_interval));
+    qe->node = node;
+    qe->lower = lower;
+    qe->upper = upper;
+    qe->freq = 0;
+    return qe;
+}
+
+int wt_topk_multi(const wt_tree *tree, const wt_interval *ranges, size_t m, size_t k, void (*callback)(void*, int32_t, int), void *user_data) {
+    topk_multi_qe *qe = topk_multi_qe_new(tree->root, m, tree->lower, tree->upper), *child;
+    size_t p, b, n = _wt_normalize_intervals(tree, ranges, m, qe->ranges);
+    for(p = 0; p < n; ++p)
+        qe->freq += qe->ranges[p].j - qe->ranges[p].i;
+
+    heap *q = heap_new();
+    if (qe->freq)
+        heap_push(q, qe->freq, qe);
+    else
+        free(qe);
+
+    int score, count = 0;
+    int32_t mid;
+    fid_ranks *ranks = malloc((n + 1) * sizeof(fid_ranks));
+    while (count < k && heap_len(q) > 0) {
+        heap_pop(q, &score, (void**)&qe);
+        WT_STAT_INC(nodes_visited);
+
+        if (qe->lower == qe->upper) {
+            ++count;
+            callback(user_data, qe->lower, qe->freq);
+        }
+        else {
+            mid = MID(qe->lower, qe->upper);
+
+            wt_kernels_active->rank_ranges(qe->node->fid, qe->ranges, n, ranks);
+            for(b = 0; b < 2; ++b) {
+                child = topk_multi_qe_new(b ? qe->node->right : qe->node->left, n, b ? mid + 1 : qe->lower, b ? qe->upper : mid);
+                for(p = 0; p < n; ++p) {
+                    child->ranges[p].i = b ? ranks[p].i1 : ranks[p].i0;
+                    child->ranges[p].j = b ? ranks[p].j1 : ranks[p].j0;
+                    child->freq += child->ranges[p].j - child->ranges[p].i;
+                }
+                if (child->freq)
+                    heap_push(q, child->freq, child);
+                else
+                    free(child);
+            }
+        }
+
+        free(qe);
+    }
+    free(ranks);
+    heap_free(q, free);
+
+    return count;
+}
+
+/*
+ * Intersection of two ranges
+ */
+
+static int _wt_range_intersect(const wt_node *cur, size_t i1, size_t j1, size_t i2, size_t j2, int32_t lower, int32_t upper,
+    void (*callback)(void*, int32_t, int, int), void *user_data) {
+    WT_STAT_INC(nodes_visited);
+    if (!cur || j1 <= i1 || j2 <= i2)
+        return 0;
+    if (lower == upper) {
+        callback(user_data, lower, j1 - i1, j2 - i2);
+        return 1;
+    }
+
+    int32_t mid = MID(lower, upper);
+    fid_ranks r1 = fid_rank_range(cur->fid, i1, j1), r2 = fid_rank_range(cur->fid, i2, j2);
+    return _wt_range_intersect(cur->left, r1.i0, r1.j0, r2.i0, r2.j0, lower, mid, callback, user_data) +
+        _wt_range_intersect(cur->right, r1.i1, r1.j1, r2.i1, r2.j1, mid + 1, upper, callback, user_data);
+}
+
+int wt_range_intersect(const wt_tree *tree, size_t i1, size_t j1, size_t i2, size_t j2,
+    void (*callback)(void*, int32_t, int, int), void *user_data) {
+    if (tree->len < j1) j1 = tree->len;
+    if (tree->len < j2) j2 = tree->len;
+    return _wt_range_intersect(tree->root, i1, j1, i2, j2, tree->lower, tree->upper, callback, user_data);
+}
+
+/*
+ * Heavy hitters
+ */
+
+static int _wt_range_heavy(const wt_node *cur, size_t i, size_t j, size_t threshold, int32_t lower, int32_t upper,
+    void (*callback)(void*, int32_t, int), void *user_data) {
+    WT_STAT_INC(nodes_visited);
+    // a subtree holding fewer than threshold elements cannot contain a heavy value
+    if (!cur || j - i < threshold)
+        return 0;
+    if (lower == upper) {
+        callback(user_data, lower, j - i);
+        return 1;
+    }
+
+    int32_t mid = MID(lower, upper);
+    fid_ranks r = fid_rank_range(cur->fid, i, j);
+    return _wt_range_heavy(cur->left, r.i0, r.j0, threshold, lower, mid, callback, user_data) +
+        _wt_range_heavy(cur->right, r.i1, r.j1, threshold, mid + 1, upper, callback, user_data);
+}
+
+int wt_range_heavy(const wt_tree *tree, size_t i, size_t j, size_t threshold, void (*callback)(void*, int32_t, int), void *user_data) {
+    if (tree->len < j) j = tree->len;
+    if (j <= i) return 0;
+    if (threshold == 0) threshold = 1;
+    return _wt_range_heavy(tree->root, i, j, threshold, tree->lower, tree->upper, callback, user_data);
+}
+
 #define WT_RANGE_SORT_MIN 0
 #define WT_RANGE_SORT_MAX 1
 
-int _wt_range_sort(const wt_node *node, int i, int j, int k, int32_t lower, int32_t upper, int flags,
+int _wt_range_sort(const wt_node *node, int i, int j, int k, int32_t lower, int32_t upper, int flags, wt_budget *budget,
     void (*callback)(void*, int32_t, int), void *user_data) {
+    if (!wt_budget_spend(budget))
+        return k;
+    WT_STAT_INC(nodes_visited);
     if (lower == upper) {
         callback(user_data, lower, j - i);
         return k - 1;
@@ -619,38 +1610,49 @@ int _wt_range_sort(const wt_node *node, int i, int j, int k, int32_t lower, int3
 
     int li, lj, ri, rj;
     int32_t mid;
-    li = fid_rank(node->fid, 0, i);
-    lj = fid_rank(node->fid, 0, j);
-    ri = fid_rank(node->fid, 1, i);
-    rj = fid_rank(node->fid, 1, j);
+    fid_ranks r = fid_rank_range(node->fid, i, j);
+    li = r.i0;
+    lj = r.j0;
+    ri = r.i1;
+    rj = r.j1;
     mid = MID(lower, upper);
 
     if (flags == WT_RANGE_SORT_MIN) {
         if (li < lj)
-            k = _wt_range_sort(node->left, li, lj, k, lower, mid, flags, callback, user_data);
+            k = _wt_range_sort(node->left, li, lj, k, lower, mid, flags, budget, callback, user_data);
     }
     else {
         if (ri < rj)
-            k = _wt_range_sort(node->right, ri, rj, k, mid+1, upper, flags, callback, user_data);
+            k = _wt_range_sort(node->right, ri, rj, k, mid+1, upper, flags, budget, callback, user_data);
     }
 
     if(k == 0) return k;
 
     if (flags == WT_RANGE_SORT_MIN) {
         if (ri < rj)
-            k = _wt_range_sort(node->right, ri, rj, k, mid+1, upper, flags, callback, user_data);
+            k = _wt_range_sort(node->right, ri, rj, k, mid+1, upper, flags, budget, callback, user_data);
     }
     else {
         if (li < lj)
-            k = _wt_range_sort(node->left, li, lj, k, lower, mid, flags, callback, user_data);
+            k = _wt_range_sort(node->left, li, lj, k, lower, mid, flags, budget, callback, user_data);
     }
     return k;
 }
 
+int wt_range_mink_budget(const wt_tree *tree, size_t i, size_t j, size_t k, wt_budget *budget,
+    void (*callback)(void*, int32_t, int), void *user_data) {
+    return k - _wt_range_sort(tree->root, i, j, k, tree->lower, tree->upper, WT_RANGE_SORT_MIN, budget, callback, user_data);
+}
+
+int wt_range_maxk_budget(const wt_tree *tree, size_t i, size_t j, size_t k, wt_budget *budget,
+    void (*callback)(void*, int32_t, int), void *user_data) {
+    return k - _wt_range_sort(tree->root, i, j, k, tree->lower, tree->upper, WT_RANGE_SORT_MAX, budget, callback, user_data);
+}
+
 int wt_range_mink(const wt_tree *tree, size_t i, size_t j, size_t k, void (*callback)(void*, int32_t, int), void *user_data) {
-    return k - _wt_range_sort(tree->root, i, j, k, MIN_ALPHABET, MAX_ALPHABET, WT_RANGE_SORT_MIN, callback, user_data);
+    return wt_range_mink_budget(tree, i, j, k, NULL, callback, user_data);
 }
 
 int wt_range_maxk(const wt_tree *tree, size_t i, size_t j, size_t k, void (*callback)(void*, int32_t, int), void *user_data) {
-    return k - _wt_range_sort(tree->root, i, j, k, MIN_ALPHABET, MAX_ALPHABET, WT_RANGE_SORT_MAX, callback, user_data);
+    return wt_range_maxk_budget(tree, i, j, k, NULL, callback, user_data);
 }
@@ -3,35 +3,50 @@
 
 #include "common.h"
 #include "heap.h"
+#include "stats.h"
 
 #define MAX_HEIGHT (32)
 #define MAX_ALPHABET 2147483647
 #define MIN_ALPHABET -2147483648
 #define DESTRUCTIVE_BUILD 1
 
-#define FID_POWER_B(fid) 5
+// Optional auxiliary indexes built alongside a tree
+#define WT_FLAG_DISTINCT 0x1
+#define WT_FLAG_SUMS 0x2
+
+// Bits are packed LSB-first into 64-bit words. The rank directory holds one
+// 64-bit entry per superblock of 1024 bits: the number of ones before the
+// superblock in the low 32 bits, then the number of ones before its second,
+// third and fourth 256-bit block in three 10-bit fields. That is 6.25% on top
+// of the bits, and rank reads one entry and popcounts at most four words.
+#define FID_POWER_W(fid) 6
+#define FID_POWER_B(fid) 8
 #define FID_POWER_SB(fid) 10
 #define FID_POWER_DIFF_B2SB(fid) (FID_POWER_SB(fid) - FID_POWER_B(fid))
-
-#define FID_NBIT_B(fid) (1<<FID_POWER_B(fid))
-#define FID_NBIT_SB(fid) (1<<FID_POWER_SB(fid))
+#define FID_POWER_DIFF_W2B(fid) (FID_POWER_B(fid) - FID_POWER_W(fid))
 
 // mask
-#define FID_MASK_BLOCK(fid) 0xFFFFFFFF
-#define FID_MASK_BOFFSET(fid) ((1<<FID_POWER_SB(fid))-1)
+#define FID_MASK_WI(fid) ((1<<FID_POWER_W(fid))-1)
 #define FID_MASK_BSEP(fid) ((1<<FID_POWER_DIFF_B2SB(fid))-1)
-#define FID_MASK_BI(fid) ((1<<FID_POWER_B(fid))-1)
-#define FID_MASK_BLOCK_I(fid, i) (((i) & FID_MASK_BI(fid)) ? (FID_MASK_BLOCK(fid) << (FID_NBIT_B(fid) - ((i) & FID_MASK_BI(fid)))) : 0)
+#define FID_MASK_WORD_I(fid, i) ((1ULL << ((i) & FID_MASK_WI(fid))) - 1)
 
 // index conversion
+#define FID_I2WI(fid, i) ((i) >> FID_POWER_W(fid))
+#define FID_WI2I(fid, i) ((i) << FID_POWER_W(fid))
 #define FID_I2BI(fid, i) ((i) >> FID_POWER_B(fid))
 #define FID_BI2I(fid, i) ((i) << FID_POWER_B(fid))
+#define FID_BI2WI(fid, i) ((i) << FID_POWER_DIFF_W2B(fid))
 #define FID_I2SBI(fid, i) ((i) >> FID_POWER_SB(fid))
 #define FID_SBI2I(fid, i) ((i) << FID_POWER_SB(fid))
-#define FID_BI2SBI(fid, i) ((i) >> FID_POWER_DIFF_B2SB(fid))
 #define FID_SBI2BI(fid, i) ((i) << FID_POWER_DIFF_B2SB(fid))
 
-#define FID_CHOP_BLOCK_I(fid, b, i) ((b) & FID_MASK_BLOCK_I(fid, i))
+// number of words and of directory entries for n bits
+#define FID_NWORDS(fid, n) (FID_I2WI(fid, n) + 1)
+#define FID_NSUPERBLOCKS(fid, n) (FID_I2SBI(fid, n) + 1)
+
+// fields of a directory entry, k being the index of a block within its superblock
+#define FID_RD_RANK(e) ((uint32_t)(e))
+#define FID_RD_BLOCK_RANK(e, k) (((((e) >> 32) << 10) >> (10 * (k))) & 0x3FF)
 
 #define MID(l, r) (((int64_t)(l) + (int64_t)(r)) >> 1)
 
@@ -41,11 +56,69 @@
 
 typedef struct fid {
     size_t n;
-    uint32_t *bs;
-    uint32_t *rs;
-    uint16_t *rb;
+    uint64_t *bs;
+    uint64_t *rd;
 } fid;
 
+fid *fid_new(uint64_t *words, size_t n);
+void fid_free(fid *fid);
+int fid_select(fid *fid, int b, int i);
+size_t fid_memory_usage(const fid *fid);
+
+// Ones before i, counted from the directory entry e of the superblock holding i
+static inline size_t _fid_rank1(const fid *fid, uint64_t e, size_t i) {
+    size_t w = FID_BI2WI(fid, FID_I2BI(fid, i)), last = FID_I2WI(fid, i);
+    size_t res = FID_RD_RANK(e) + FID_RD_BLOCK_RANK(e, FID_I2BI(fid, i) & FID_MASK_BSEP(fid));
+    for(; w < last; ++w)
+        res += __builtin_popcountll(fid->bs[w]);
+    // bs always has a word past the last bit, so the masked read is safe at i == n
+    return res + __builtin_popcountll(fid->bs[last] & FID_MASK_WORD_I(fid, i));
+}
+
+static inline int fid_rank(fid *fid, int b, size_t i) {
+    WT_STAT_INC(fid_rank_calls);
+    if (fid->n < i) i = fid->n;
+    size_t res = _fid_rank1(fid, fid->rd[FID_I2SBI(fid, i)], i);
+    return b ? res : i - res;
+}
+
+// Zeros (i0, j0) and ones (i1, j1) before both ends of [i, j)
+typedef struct fid_ranks {
+    size_t i0, j0, i1, j1;
+} fid_ranks;
+
+// Ranks both ends of a range at once. When they share a block only the words
+// between them are counted on top of the rank of i, and when they share a
+// superblock its directory entry is read once.
+static inline fid_ranks fid_rank_range(fid *fid, size_t i, size_t j) {
+    WT_STAT_INC(fid_rank_calls);
+    fid_ranks r;
+    if (fid->n < i) i = fid->n;
+    if (fid->n < j) j = fid->n;
+    uint64_t e = fid->rd[FID_I2SBI(fid, i)];
+    r.i1 = _fid_rank1(fid, e, i);
+    if (i <= j && FID_I2BI(fid, i) == FID_I2BI(fid, j)) {
+        size_t w = FID_I2WI(fid, i), last = FID_I2WI(fid, j);
+        uint64_t word = fid->bs[w] & ~FID_MASK_WORD_I(fid, i);
+        r.j1 = r.i1;
+        for(; w < last; word = fid->bs[++w])
+            r.j1 += __builtin_popcountll(word);
+        r.j1 += __builtin_popcountll(word & FID_MASK_WORD_I(fid, j));
+    }
+    else {
+        if (FID_I2SBI(fid, i) != FID_I2SBI(fid, j))
+            e = fid->rd[FID_I2SBI(fid, j)];
+        r.j1 = _fid_rank1(fid, e, j);
+    }
+    r.i0 = i - r.i1;
+    r.j0 = j - r.j1;
+    return r;
+}
+
+static inline int fid_access(fid *fid, size_t i) {
+    return (fid->bs[FID_I2WI(fid, i)] >> (i & FID_MASK_WI(fid))) & 1;
+}
+
 /*
  * Wavelet Tree
  */
@@ -54,25 +127,128 @@ typedef struct wt_node {
     struct wt_node *parent, *left, *right;
     fid *fid;
     int n;
+    // Prefix sums of the values in this node for WT_FLAG_SUMS
+    int64_t *sums;
 } wt_node;
 
+// Elements must lie within [lower, upper], which is the whole 32-bit range
+// for trees created by wt_new. The height of a tree is log2(upper - lower + 1).
 typedef struct wt_tree {
     wt_node *root;
     size_t len;
+    int32_t lower, upper;
+    int flags;
+    // Previous occurrence positions for WT_FLAG_DISTINCT
+    struct wt_tree *prev;
+    // Stamped by the owner to tell rebuilt trees apart, e.g. for result caching
+    unsigned long long generation;
 } wt_tree;
 
+// Bytes held by one level of a tree, or by a whole tree, per component
+typedef struct wt_level_usage {
+    size_t nodes;
+    // bits indexed by the bitvectors
+    size_t bits;
+    // wt_node and fid structs
+    size_t headers;
+    // bitvector words and rank directory
+    size_t bs, rd;
+    // prefix sums for WT_FLAG_SUMS
+    size_t sums;
+} wt_level_usage;
+
+typedef struct wt_usage {
+    size_t len, distinct, height, nodes;
+    // total bytes, equal to wt_memory_usage
+    size_t bytes;
+    // bytes of the auxiliary tree of WT_FLAG_DISTINCT, not broken down below
+    size_t aux;
+    wt_level_usage total;
+    wt_level_usage levels[MAX_HEIGHT + 1];
+} wt_usage;
+
+// Limit on the nodes visited by a traversal and on its wall-clock time, zero meaning unlimited.
+// Traversals taking a budget stop early once it is exhausted, leaving the results reported so far.
+typedef struct wt_budget {
+    size_t max_work;
+    uint64_t deadline;
+    size_t work;
+    int exhausted;
+} wt_budget;
+
+// The clock is read once every WT_BUDGET_CLOCK_INTERVAL visits
+#define WT_BUDGET_CLOCK_INTERVAL 64
+
+uint64_t wt_clock_ns(void);
+void wt_budget_init(wt_budget *budget, size_t max_work, uint64_t timeout_ms);
+
+static inline int wt_budget_spend(wt_budget *budget) {
+    if (!budget) return 1;
+    if (budget->exhausted) return 0;
+    ++budget->work;
+    if ((budget->max_work && budget->max_work < budget->work) ||
+            (budget->deadline && budget->work % WT_BUDGET_CLOCK_INTERVAL == 0 && budget->deadline <= wt_clock_ns()))
+        budget->exhausted = 1;
+    return !budget->exhausted;
+}
+
+typedef struct wt_interval {
+    size_t i, j;
+} wt_interval;
+
+// Thread safety: wt_build and wt_free need exclusive access to a tree, while
+// every other function below only reads it and keeps its state on the stack
+// or in memory it allocates, so any number of threads may query one built
+// tree concurrently. Callbacks run on the calling thread. The only shared
+// writes are the counters of -DWT_STATS, which are not atomic.
 wt_tree *wt_new(void);
+wt_tree *wt_new_bounded(int32_t lower, int32_t upper);
 void wt_build(wt_tree *tree, int32_t *data, size_t len);
+// Threads used by wt_build for sequences of at least 65536 elements, 1 by
+// default. More than one needs a scratch copy of the sequence during the build.
+void wt_set_build_threads(int threads);
 void wt_free(wt_tree *tree);
+size_t wt_memory_usage(const wt_tree *tree);
+void wt_memory_report(const wt_tree *tree, wt_usage *usage);
 int wt_access(const wt_tree *cur, size_t i, int32_t *res);
+size_t wt_get_range(const wt_tree *tree, size_t i, size_t j, int32_t *out);
 int wt_rank(const wt_tree *cur, int32_t value, int i);
 int wt_select(const wt_tree *cur, int32_t v, size_t i);
+int wt_next_pos(const wt_tree *tree, int32_t v, size_t i);
+int wt_prev_pos(const wt_tree *tree, int32_t v, size_t j);
+size_t wt_positions(const wt_tree *tree, int32_t v, size_t i, size_t j, size_t offset, size_t count, size_t *res, size_t *total);
 int wt_quantile(const wt_tree *cur, size_t k, size_t i, size_t j, int32_t *res);
+int wt_quantiles(const wt_tree *tree, size_t i, size_t j, const size_t *ks, size_t n, int32_t *res);
+int wt_quantile_approx(const wt_tree *tree, size_t i, size_t j, size_t k, int depth, int32_t *lower, int32_t *upper);
+void wt_range_freq_approx(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_t y, int depth, int *lower, int *upper);
 int wt_range_freq(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_t y);
+int wt_range_hist(const wt_tree *tree, size_t i, size_t j, const int32_t *edges, size_t m, int *counts);
+int wt_range_less(const wt_tree *tree, size_t i, size_t j, int32_t value);
+int wt_range_distinct(const wt_tree *tree, size_t i, size_t j);
+int64_t wt_range_sum(const wt_tree *tree, size_t i, size_t j, int64_t x, int64_t y);
+int64_t wt_kth_sum(const wt_tree *tree, size_t i, size_t j, size_t k);
+int wt_range_list_budget(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_t y, wt_budget *budget,
+    void (*callback)(void*, int32_t, int), void *user_data);
 int wt_range_list(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_t y, void (*callback)(void*, int32_t, int), void *user_data);
 int32_t wt_prev_value(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_t y);
 int32_t wt_next_value(const wt_tree *tree, size_t i, size_t j, int32_t x, int32_t y);
+int wt_topk_budget(const wt_tree *tree, size_t i, size_t j, size_t k, wt_budget *budget,
+    void (*callback)(void*, int32_t, int), void *user_data);
 int wt_topk(const wt_tree *tree, size_t i, size_t j, size_t k, void (*callback)(void*, int32_t, int), void *user_data);
+size_t wt_sliding_windows(const wt_tree *tree, size_t i, size_t j, size_t window, size_t step);
+size_t wt_sliding_quantile(const wt_tree *tree, size_t i, size_t j, size_t window, size_t step, size_t k, int32_t *res);
+size_t wt_sliding_topk(const wt_tree *tree, size_t i, size_t j, size_t window, size_t step, size_t k,
+    void (*window_callback)(void*, size_t), void (*callback)(void*, int32_t, int), void *user_data);
+int wt_quantile_multi(const wt_tree *tree, const wt_interval *ranges, size_t m, size_t k, int32_t *res);
+int wt_range_freq_multi(const wt_tree *tree, const wt_interval *ranges, size_t m, int32_t x, int32_t y);
+int wt_topk_multi(const wt_tree *tree, const wt_interval *ranges, size_t m, size_t k, void (*callback)(void*, int32_t, int), void *user_data);
+int wt_range_intersect(const wt_tree *tree, size_t i1, size_t j1, size_t i2, size_t j2,
+    void (*callback)(void*, int32_t, int, int), void *user_data);
+int wt_range_heavy(const wt_tree *tree, size_t i, size_t j, size_t threshold, void (*callback)(void*, int32_t, int), void *user_data);
+int wt_range_mink_budget(const wt_tree *tree, size_t i, size_t j, size_t k, wt_budget *budget,
+    void (*callback)(void*, int32_t, int), void *user_data);
+int wt_range_maxk_budget(const wt_tree *tree, size_t i, size_t j, size_t k, wt_budget *budget,
+    void (*callback)(void*, int32_t, int), void *user_data);
 int wt_range_mink(const wt_tree *tree, size_t i, size_t j, size_t k, void (*callback)(void*, int32_t, int), void *user_data);
 int wt_range_maxk(const wt_tree *tree, size_t i, size_t j, size_t k, void (*callback)(void*, int32_t, int), void *user_data);
 
@@ -0,0 +1,24 @@
+#ifndef __WVLTR_CORE_H__
+#define __WVLTR_CORE_H__
+
+// Public header of the standalone core library built by make core, for
+// programs using the data structures without Redis. Link with -lwvltr_core
+// -lpthread. Memory comes from wt_set_allocator, the C library by default.
+#ifndef WT_CORE
+#define WT_CORE
+#endif
+
+#include "wavelet_tree.h"
+#include "point_grid.h"
+#include "fm_index.h"
+#include "kernels.h"
+#include "batch.h"
+
+// common.h renames the allocation functions for the sources of the library
+// only, so they are given back to the including program
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+
+#endif